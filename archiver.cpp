@@ -0,0 +1,185 @@
+#include "archiver.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <zlib.h>
+
+using namespace logger;
+
+Archiver::Archiver(int compression_level, size_t max_pending)
+    : compression_level_(compression_level), max_pending_(max_pending) {
+    thread_ = thread([this] {
+        ArchiverThread();
+    });
+}
+
+Archiver::~Archiver() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        is_running_ = false;
+    }
+    condition_variable_.notify_all();
+    thread_.join();
+}
+
+bool Archiver::Submit(const string& source, const string& destination, function<void()> done,
+                      shared_ptr<const SegmentIndex> index) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (jobs_.size() >= max_pending_) {
+            deferred_jobs_.push(Job{source, destination, move(done), move(index)});
+            skipped_files_.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        jobs_.push(Job{source, destination, move(done), move(index)});
+        pending_sources_.insert(source);
+    }
+    condition_variable_.notify_one();
+    return true;
+}
+
+void Archiver::Post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        tasks_.push(move(task));
+    }
+    condition_variable_.notify_one();
+}
+
+// Called with mutex_ held. A deferred source is not pending, so retention
+// may have removed it in the meantime.
+void Archiver::StartDeferred() {
+    while (!deferred_jobs_.empty() && jobs_.size() < max_pending_) {
+        Job job = move(deferred_jobs_.front());
+        deferred_jobs_.pop();
+        if (!filesystem::exists(job.source))
+            continue;
+        pending_sources_.insert(job.source);
+        jobs_.push(move(job));
+    }
+}
+
+bool Archiver::IsPending(const string& source) {
+    lock_guard<mutex> lock(mutex_);
+    return pending_sources_.count(source) > 0;
+}
+
+void Archiver::ArchiverThread() {
+    while (true) {
+        Job job;
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(mutex_);
+            condition_variable_.wait(lock, [this] { return !jobs_.empty() || !tasks_.empty() || !is_running_; });
+            if (!tasks_.empty()) {
+                task = move(tasks_.front());
+                tasks_.pop();
+            } else if (!jobs_.empty()) {
+                job = move(jobs_.front());
+                jobs_.pop();
+            } else {
+                break;
+            }
+        }
+        if (task) {
+            task();
+            continue;
+        }
+        auto start = chrono::steady_clock::now();
+        if (CompressFile(job.source, job.destination, job.index.get()) == 0) {
+            remove(job.source.c_str());
+            // Left by the sink when the job was deferred.
+            remove((job.source + ".idx").c_str());
+            archived_files_.fetch_add(1, memory_order_relaxed);
+            archive_nanoseconds_.fetch_add(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count(), memory_order_relaxed);
+        } else if (job.index && filesystem::exists(job.source)) {
+            job.index->Write(job.source + ".idx");
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            pending_sources_.erase(job.source);
+            StartDeferred();
+        }
+        if (job.done)
+            job.done();
+    }
+}
+
+// Each block of the index starts after a full flush, so that a reader can
+// inflate from there without the data before it.
+int Archiver::CompressFile(const string& source, const string& destination, const SegmentIndex* index) {
+    FILE* infile = fopen(source.c_str(), "rb");
+    if (!infile)
+        return -1;
+    string mode = "wb";
+    if (compression_level_ >= 0)
+        mode += to_string(compression_level_);
+    gzFile outfile = gzopen(destination.c_str(), mode.c_str());
+    if (!outfile) {
+        fclose(infile);
+        return -1;
+    }
+    gzbuffer(outfile, kChunkSize);
+
+    SegmentIndex compressed_index;
+    if (index && index->base_offset == 0 && !index->blocks.empty()) {
+        compressed_index = *index;
+        compressed_index.is_compressed = true;
+        compressed_index.blocks[0].offset = 0;
+        compressed_index.blocks[0].compressed_offset = 0;
+    }
+    vector<SegmentIndex::Block>& blocks = compressed_index.blocks;
+    size_t next_block = 1;
+
+    unique_ptr<char[]> buffer(new char[kChunkSize]);
+    size_t num_read = 0;
+    size_t total_read = 0;
+    int result = 0;
+    while (result == 0 && (num_read = fread(buffer.get(), 1, kChunkSize, infile)) > 0) {
+        size_t position = 0;
+        while (position < num_read) {
+            size_t count = num_read - position;
+            if (next_block < blocks.size())
+                count = min<size_t>(count, blocks[next_block].offset - (total_read + position));
+            if (count > 0 && gzwrite(outfile, buffer.get() + position, count) != (int)count) {
+                result = -1;
+                break;
+            }
+            position += count;
+            if (next_block < blocks.size() && total_read + position == blocks[next_block].offset) {
+                if (gzflush(outfile, Z_FULL_FLUSH) != Z_OK) {
+                    result = -1;
+                    break;
+                }
+                blocks[next_block++].compressed_offset = gzoffset(outfile);
+            }
+        }
+        total_read += num_read;
+    }
+    if (ferror(infile))
+        result = -1;
+    fclose(infile);
+    if (gzclose(outfile) != Z_OK)
+        result = -1;
+    if (result == 0) {
+        error_code error;
+        if (!blocks.empty()) {
+            blocks.resize(next_block);
+            compressed_index.Write(destination + ".idx");
+        }
+        input_bytes_.fetch_add(total_read, memory_order_relaxed);
+        output_bytes_.fetch_add(filesystem::file_size(destination, error), memory_order_relaxed);
+    }
+    return result;
+}
+
+Archiver::Stats Archiver::GetStats() const {
+    return {archived_files_.load(memory_order_relaxed),
+            archive_nanoseconds_.load(memory_order_relaxed) / 1e9,
+            input_bytes_.load(memory_order_relaxed),
+            output_bytes_.load(memory_order_relaxed),
+            skipped_files_.load(memory_order_relaxed)};
+}
@@ -0,0 +1,84 @@
+#ifndef _ARCHIVER_HPP_
+#define _ARCHIVER_HPP_
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include "segment_index.hpp"
+
+namespace logger {
+    using namespace std;
+
+    // Does the file work of rotation on its own thread: compressing rotated
+    // files and short tasks such as opening the next file or removing old
+    // ones. Tasks run in order and ahead of waiting compressions.
+    class Archiver
+    {
+    public:
+        static constexpr size_t kChunkSize = 256 * 1024;
+
+        Archiver(int compression_level, size_t max_pending);
+        ~Archiver();
+
+        // Returns false when max_pending jobs are already waiting; the source
+        // file is then left uncompressed for now and retried, if it is still
+        // there, once a job finishes. done runs after the compression.
+        // With the source's index, the compressed file gets restart points
+        // at its blocks and an index of its own.
+        bool Submit(const string& source, const string& destination, function<void()> done = nullptr,
+                    shared_ptr<const SegmentIndex> index = nullptr);
+        void Post(function<void()> task);
+        // The source of a job that is waiting or being compressed; it must
+        // stay where it is until the job is done.
+        bool IsPending(const string& source);
+
+        struct Stats
+        {
+            uint64_t archived_files;
+            double seconds;
+            uint64_t input_bytes;
+            uint64_t output_bytes;
+            uint64_t skipped_files;
+        };
+
+        Stats GetStats() const;
+
+    private:
+        struct Job
+        {
+            string source;
+            string destination;
+            function<void()> done;
+            shared_ptr<const SegmentIndex> index;
+        };
+
+        void ArchiverThread();
+        void StartDeferred();
+        int CompressFile(const string& source, const string& destination, const SegmentIndex* index);
+
+        atomic<uint64_t> archived_files_ = 0;
+        atomic<uint64_t> archive_nanoseconds_ = 0;
+        atomic<uint64_t> input_bytes_ = 0;
+        atomic<uint64_t> output_bytes_ = 0;
+        atomic<uint64_t> skipped_files_ = 0;
+
+        int compression_level_;
+        size_t max_pending_;
+        mutex mutex_;
+        condition_variable condition_variable_;
+        queue<Job> jobs_;
+        // Jobs refused by Submit(), oldest first.
+        queue<Job> deferred_jobs_;
+        set<string> pending_sources_;
+        queue<function<void()>> tasks_;
+        bool is_running_ = true;
+        thread thread_;
+    };
+}
+#endif
@@ -0,0 +1,131 @@
+#include "backend.hpp"
+#include "logger.hpp"
+#include <algorithm>
+
+using namespace logger;
+
+size_t Backend::thread_count_ = 2;
+
+namespace {
+    thread_local bool is_backend_thread = false;
+}
+
+Backend& Backend::Instance() {
+    static Backend backend(thread_count_);
+    return backend;
+}
+
+void Backend::SetThreadCount(size_t thread_count) {
+    thread_count_ = thread_count > 0 ? thread_count : 1;
+}
+
+Backend::Backend(size_t thread_count) : snapshot_generations_(thread_count, kIdle) {
+    for (size_t i = 0; i < thread_count; i++) {
+        threads_.emplace_back([this, i] {
+            BackendThread(i);
+        });
+    }
+}
+
+Backend::~Backend() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        is_running_ = false;
+    }
+    condition_variable_.notify_all();
+    for (thread& t : threads_)
+        t.join();
+}
+
+void Backend::Register(Logger* logger) {
+    lock_guard<mutex> lock(mutex_);
+    loggers_.push_back(logger);
+}
+
+// Threads that copied loggers_ before the removal may still visit the
+// logger; waits until each of them has moved on to a newer copy or sleeps.
+void Backend::Unregister(Logger* logger) {
+    unique_lock<mutex> lock(mutex_);
+    loggers_.erase(remove(loggers_.begin(), loggers_.end(), logger), loggers_.end());
+    uint64_t generation = ++generation_;
+    snapshot_released_.wait(lock, [this, generation] {
+        return all_of(snapshot_generations_.begin(), snapshot_generations_.end(),
+                      [generation](uint64_t snapshot) { return snapshot >= generation; });
+    });
+}
+
+void Backend::Wake() {
+    // Pairs with the fence in BackendThread, as in Logger::WakeLoggerThread.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping_threads_.load(memory_order_relaxed) > 0) {
+        lock_guard<mutex> lock(mutex_);
+        condition_variable_.notify_one();
+    }
+}
+
+// Called with mutex_ held.
+void Backend::ReleaseSnapshot(size_t index, uint64_t generation) {
+    bool is_older = snapshot_generations_[index] < generation_;
+    snapshot_generations_[index] = generation;
+    if (is_older)
+        snapshot_released_.notify_all();
+}
+
+bool Backend::IsBackendThread() {
+    return is_backend_thread;
+}
+
+void Backend::BackendThread(size_t index) {
+    is_backend_thread = true;
+    vector<Logger*> loggers;
+    while (true) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!is_running_) {
+                ReleaseSnapshot(index, kIdle);
+                break;
+            }
+            loggers = loggers_;
+            ReleaseSnapshot(index, generation_);
+        }
+
+        bool is_work_done = false;
+        unsigned int timeout_ms = 0;
+        size_t start = next_logger_.fetch_add(1, memory_order_relaxed);
+        for (size_t i = 0; i < loggers.size(); i++) {
+            Logger* logger = loggers[(start + i) % loggers.size()];
+            if (logger->is_consumer_busy_.exchange(true, memory_order_acquire))
+                continue;
+            unsigned int logger_timeout_ms = 0;
+            if (logger->ProcessBatch(logger_timeout_ms))
+                is_work_done = true;
+            logger->is_consumer_busy_.store(false, memory_order_release);
+            if (logger_timeout_ms > 0 && (timeout_ms == 0 || logger_timeout_ms < timeout_ms))
+                timeout_ms = logger_timeout_ms;
+        }
+        if (is_work_done)
+            continue;
+
+        unique_lock<mutex> lock(mutex_);
+        ReleaseSnapshot(index, kIdle);
+        sleeping_threads_.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        auto ready = [this] { return !is_running_ || HasPendingWork(); };
+        if (timeout_ms > 0)
+            condition_variable_.wait_for(lock, chrono::milliseconds(timeout_ms), ready);
+        else
+            condition_variable_.wait(lock, ready);
+        sleeping_threads_.fetch_sub(1, memory_order_relaxed);
+    }
+}
+
+// Called with mutex_ held.
+bool Backend::HasPendingWork() {
+    for (Logger* logger : loggers_) {
+        // A logger being served is picked up again by the thread serving it.
+        if (!logger->is_consumer_busy_.load(memory_order_relaxed) &&
+            (logger->IsFlushRequested() || logger->HasPendingMessages()))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef _BACKEND_HPP_
+#define _BACKEND_HPP_
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logger {
+    using namespace std;
+
+    class Logger;
+
+    // Process-wide pool of I/O threads serving every Logger configured with
+    // the "backend" key. Loggers are visited round-robin and each visit
+    // handles at most one batch, so a busy logger cannot starve the others.
+    // All loggers using it must be destroyed before the process exits.
+    class Backend
+    {
+    public:
+        static Backend& Instance();
+        // Takes effect only if called before the first logger registers.
+        static void SetThreadCount(size_t thread_count);
+
+        ~Backend();
+
+        void Register(Logger* logger);
+        // Returns once no backend thread is serving the logger any more.
+        void Unregister(Logger* logger);
+        void Wake();
+        // True on the pool's threads, which serve every backend logger.
+        static bool IsBackendThread();
+
+    private:
+        // Generation of a thread that holds no copy of loggers_.
+        static constexpr uint64_t kIdle = UINT64_MAX;
+
+        Backend(size_t thread_count);
+        void BackendThread(size_t index);
+        bool HasPendingWork();
+        void ReleaseSnapshot(size_t index, uint64_t generation);
+
+        static size_t thread_count_;
+
+        mutex mutex_;
+        condition_variable condition_variable_;
+        vector<Logger*> loggers_;
+        // Bumped by Unregister(); each thread records the generation of the
+        // copy of loggers_ it is visiting.
+        uint64_t generation_ = 0;
+        vector<uint64_t> snapshot_generations_;
+        condition_variable snapshot_released_;
+        atomic<size_t> next_logger_ = 0;
+        atomic<size_t> sleeping_threads_ = 0;
+        bool is_running_ = true;
+        vector<thread> threads_;
+    };
+}
+#endif
@@ -0,0 +1,224 @@
+// Producer latency and throughput of the logger for a set of output
+// configurations and producer thread counts. Results are written as JSON
+// to stdout (or --out); the logger's own console output goes to /dev/null.
+//
+// Usage: logger_bench [--threads N] [--records N] [--dir PATH]
+//                     [--scenario NAME]... [--out FILE]
+#include "logger.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+
+using namespace logger;
+
+namespace {
+    struct Scenario
+    {
+        const char* name;
+        // "{dir}" is replaced with the scenario's directory.
+        const char* config;
+    };
+
+    const Scenario kScenarios[] = {
+        {"std", "std,lev=7,date,time"},
+        {"file", "file={dir}/bench.log,lev=7,date,time"},
+        {"rotate_archive", "file={dir}/bench.log,lev=7,date,time,trunc=4M,archive"},
+        // Worst case for rotation stalls: a new file every few dozen records.
+        {"tiny_trunc", "file={dir}/bench.log,lev=7,date,time,trunc=4K,archive,keep=16"},
+    };
+
+    enum Api
+    {
+        API_STRING, API_FORMAT
+    };
+
+    struct Options
+    {
+        size_t max_threads = 4;
+        size_t records = 100000;
+        string directory = "/tmp/logger_bench";
+        vector<string> scenarios;
+        string output;
+    };
+
+    struct Result
+    {
+        string scenario;
+        Api api;
+        size_t threads;
+        size_t records;
+        double producer_seconds;
+        double total_seconds;
+        int64_t p50;
+        int64_t p99;
+        int64_t p999;
+        int64_t max;
+    };
+
+    string ReplaceDirectory(string config, const string& directory) {
+        size_t pos = config.find("{dir}");
+        if (pos != string::npos)
+            config.replace(pos, 5, directory);
+        return config;
+    }
+
+    int64_t Percentile(const vector<int64_t>& sorted, double fraction) {
+        if (sorted.empty())
+            return 0;
+        size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+        return sorted[index];
+    }
+
+    // Producer latency is the time spent inside one Info() call; throughput
+    // counts until Flush() returns, i.e. until every record is written.
+    Result Run(const Scenario& scenario, Api api, size_t thread_count, const Options& options) {
+        string directory = options.directory + "/" + scenario.name;
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+
+        Logger* logger = new Logger(ReplaceDirectory(scenario.config, directory));
+        vector<vector<int64_t>> latencies(thread_count);
+        for (auto& samples : latencies)
+            samples.resize(options.records);
+
+        atomic<size_t> ready_threads = 0;
+        atomic_bool is_started = false;
+        vector<thread> threads;
+        for (size_t t = 0; t < thread_count; t++) {
+            threads.emplace_back([&, t] {
+                string message = "benchmark record from producer " + to_string(t) + " with some payload text";
+                vector<int64_t>& samples = latencies[t];
+                ready_threads++;
+                while (!is_started.load(memory_order_acquire))
+                    this_thread::yield();
+                for (size_t i = 0; i < options.records; i++) {
+                    int64_t start = TimestampNow();
+                    if (api == API_STRING)
+                        logger->Info(message);
+                    else
+                        logger->Info("benchmark record {} from producer {} value {}", i, t, 0.5 * i);
+                    samples[i] = TimestampNow() - start;
+                }
+            });
+        }
+        while (ready_threads.load() < thread_count)
+            this_thread::yield();
+
+        int64_t start = TimestampNow();
+        is_started.store(true, memory_order_release);
+        for (thread& t : threads)
+            t.join();
+        int64_t produced = TimestampNow();
+        logger->Flush();
+        int64_t finished = TimestampNow();
+        delete logger;
+        filesystem::remove_all(directory);
+
+        vector<int64_t> all;
+        all.reserve(thread_count * options.records);
+        for (auto& samples : latencies)
+            all.insert(all.end(), samples.begin(), samples.end());
+        sort(all.begin(), all.end());
+
+        Result result;
+        result.scenario = scenario.name;
+        result.api = api;
+        result.threads = thread_count;
+        result.records = thread_count * options.records;
+        result.producer_seconds = (produced - start) / 1e9;
+        result.total_seconds = (finished - start) / 1e9;
+        result.p50 = Percentile(all, 0.5);
+        result.p99 = Percentile(all, 0.99);
+        result.p999 = Percentile(all, 0.999);
+        result.max = all.empty() ? 0 : all.back();
+        return result;
+    }
+
+    void WriteJson(FILE* out, const Options& options, const vector<Result>& results) {
+        fprintf(out, "{\n  \"benchmark\": \"logger_bench\",\n");
+        fprintf(out, "  \"records_per_thread\": %zu,\n", options.records);
+        fprintf(out, "  \"hardware_threads\": %u,\n", thread::hardware_concurrency());
+        fprintf(out, "  \"results\": [");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            fprintf(out, "%s\n    {\"scenario\": \"%s\", \"api\": \"%s\", \"threads\": %zu, \"records\": %zu, "
+                    "\"producer_seconds\": %.6f, \"total_seconds\": %.6f, "
+                    "\"producer_records_per_second\": %.0f, \"records_per_second\": %.0f, "
+                    "\"latency_ns\": {\"p50\": %lld, \"p99\": %lld, \"p99_9\": %lld, \"max\": %lld}}",
+                    i ? "," : "", r.scenario.c_str(), r.api == API_STRING ? "string" : "format",
+                    r.threads, r.records, r.producer_seconds, r.total_seconds,
+                    r.records / r.producer_seconds, r.records / r.total_seconds,
+                    (long long)r.p50, (long long)r.p99, (long long)r.p999, (long long)r.max);
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+    bool ParseOptions(int argc, char* argv[], Options& options) {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (i + 1 >= argc)
+                return false;
+            string value = argv[++i];
+            if (arg == "--threads")
+                options.max_threads = max<size_t>(1, stoul(value));
+            else if (arg == "--records")
+                options.records = max<size_t>(1, stoul(value));
+            else if (arg == "--dir")
+                options.directory = value;
+            else if (arg == "--scenario")
+                options.scenarios.push_back(value);
+            else if (arg == "--out")
+                options.output = value;
+            else
+                return false;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [--threads N] [--records N] [--dir PATH] [--scenario NAME]... [--out FILE]\n", argv[0]);
+        return 2;
+    }
+
+    // Keep the results apart from what the "std" scenario writes to stdout.
+    int json_fd = options.output.empty() ? dup(STDOUT_FILENO)
+                                         : open(options.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (json_fd < 0 || null_fd < 0) {
+        perror("logger_bench");
+        return 1;
+    }
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    vector<size_t> thread_counts;
+    for (size_t count = 1; count < options.max_threads; count *= 2)
+        thread_counts.push_back(count);
+    thread_counts.push_back(options.max_threads);
+
+    vector<Result> results;
+    for (const Scenario& scenario : kScenarios) {
+        if (!options.scenarios.empty() &&
+            find(options.scenarios.begin(), options.scenarios.end(), scenario.name) == options.scenarios.end())
+            continue;
+        for (Api api : {API_STRING, API_FORMAT}) {
+            for (size_t thread_count : thread_counts) {
+                results.push_back(Run(scenario, api, thread_count, options));
+                fprintf(stderr, "%s/%s/%zu: %.0f records/s\n", scenario.name, api == API_STRING ? "string" : "format",
+                        thread_count, results.back().records / results.back().total_seconds);
+            }
+        }
+    }
+
+    FILE* out = fdopen(json_fd, "w");
+    WriteJson(out, options, results);
+    fclose(out);
+    return 0;
+}
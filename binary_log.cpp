@@ -0,0 +1,148 @@
+#include "binary_log.hpp"
+#include "logger.hpp"
+#include <unordered_map>
+
+using namespace logger;
+
+namespace {
+    bool ReadExact(gzFile file, void* data, size_t size) {
+        return size == 0 || gzread(file, data, static_cast<unsigned int>(size)) == static_cast<int>(size);
+    }
+
+    template <typename T>
+    bool ReadValue(gzFile file, T& value) {
+        return ReadExact(file, &value, sizeof(T));
+    }
+}
+
+size_t binary::SegmentEnd(const char* data, size_t size) {
+    auto read_u32 = [data](size_t position) {
+        uint32_t value;
+        memcpy(&value, data + position, sizeof(value));
+        return value;
+    };
+    size_t end = 0;
+    size_t position = 0;
+    size_t category_size = sizeof(uint16_t);
+    while (position < size) {
+        size_t length;
+        switch (data[position]) {
+        case 0:
+            position++;
+            continue;
+        case SEGMENT_HEADER:
+            length = 1 + sizeof(kMagic) + 2;
+            if (position + length <= size)
+                category_size = data[position + 1 + sizeof(kMagic)] >= 2 ? sizeof(uint16_t) : 0;
+            break;
+        case FORMAT_DEFINITION:
+            length = 1 + 4 + 4;
+            if (position + length <= size)
+                length += read_u32(position + 5);
+            break;
+        case CATEGORY_DEFINITION:
+            length = 1 + 2 + 4;
+            if (position + length <= size)
+                length += read_u32(position + 3);
+            break;
+        case LOG_RECORD:
+            length = 1 + 1 + category_size + 8 + 4 + 4;
+            if (position + length <= size)
+                length += read_u32(position + length - 4);
+            break;
+        default:
+            return end;
+        }
+        if (length > size - position)
+            break;
+        position += length;
+        end = position;
+    }
+    return end;
+}
+
+bool binary::DecodeSegment(gzFile file, const function<void(uint8_t level, int64_t timestamp, const string& line)>& on_record) {
+    TimestampFormatter timestamp_formatter;
+    unordered_map<uint32_t, string> formats;
+    unordered_map<uint16_t, string> categories;
+    string payload;
+    string line;
+    bool is_header_seen = false;
+    uint8_t segment_version = kVersion;
+    unsigned char type;
+
+    while (ReadValue(file, type)) {
+        // Unused preallocated space of a memory-mapped segment.
+        if (type == 0)
+            continue;
+        if (type == SEGMENT_HEADER) {
+            char magic[sizeof(kMagic)];
+            uint8_t version, flags;
+            if (!ReadExact(file, magic, sizeof(magic)) || !ReadValue(file, version) || !ReadValue(file, flags))
+                break;
+            if (memcmp(magic, kMagic, sizeof(magic)) != 0 || version < 1 || version > kVersion)
+                return false;
+            timestamp_formatter.Configure(flags & DATE_LOGGING, flags & TIME_LOGGING);
+            formats.clear();
+            categories.clear();
+            segment_version = version;
+            is_header_seen = true;
+        } else if (!is_header_seen) {
+            return false;
+        } else if (type == FORMAT_DEFINITION) {
+            uint32_t id, length;
+            if (!ReadValue(file, id) || !ReadValue(file, length))
+                break;
+            string format(length, '\0');
+            if (!ReadExact(file, format.data(), length))
+                break;
+            formats[id] = move(format);
+        } else if (type == CATEGORY_DEFINITION) {
+            uint16_t id;
+            uint32_t length;
+            if (!ReadValue(file, id) || !ReadValue(file, length))
+                break;
+            string name(length, '\0');
+            if (!ReadExact(file, name.data(), length))
+                break;
+            categories[id] = move(name);
+        } else if (type == LOG_RECORD) {
+            uint8_t level;
+            uint16_t category = 0;
+            int64_t timestamp;
+            uint32_t format_id, size;
+            if (!ReadValue(file, level) || (segment_version >= 2 && !ReadValue(file, category)) || !ReadValue(file, timestamp) ||
+                !ReadValue(file, format_id) || !ReadValue(file, size))
+                break;
+            payload.resize(size);
+            if (!ReadExact(file, payload.data(), size))
+                break;
+            if (level < EMERGENCY || level > DEBUG)
+                return false;
+
+            string_view category_name;
+            if (category != 0) {
+                auto name = categories.find(category);
+                if (name == categories.end())
+                    return false;
+                category_name = name->second;
+            }
+
+            line.clear();
+            AppendRecordPrefix(line, timestamp_formatter, static_cast<LogLevel>(level), timestamp, category_name);
+            if (format_id == 0) {
+                line += payload;
+            } else {
+                auto format = formats.find(format_id);
+                if (format == formats.end())
+                    return false;
+                FormatArgs(format->second.c_str(), payload.data(), payload.size(), line);
+            }
+            line += '\n';
+            on_record(level, timestamp, line);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef _BINARY_LOG_HPP_
+#define _BINARY_LOG_HPP_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <zlib.h>
+
+// Layout of binary log segments, shared by the logger, logdecode and logquery.
+// A segment is a stream of records, each starting with a type byte:
+//   'H' magic[4] version:u8 flags:u8                  segment header
+//   'F' id:u32 length:u32 bytes                       format definition
+//   'C' id:u16 length:u32 bytes                       category name
+//   'R' level:u8 category:u16 timestamp:i64 format_id:u32 size:u32 payload
+// Format id 0 means the payload is the message text; otherwise it holds the
+// encoded arguments for the format defined earlier in the same segment.
+// Category 0 is none; others are defined earlier in the segment. Version 1
+// segments have neither 'C' records nor the category field.
+// Integers are stored in host byte order.
+namespace logger {
+namespace binary {
+    using namespace std;
+
+    constexpr char kMagic[4] = {'L', 'O', 'G', 'B'};
+    constexpr uint8_t kVersion = 2;
+
+    enum RecordType : uint8_t
+    {
+        SEGMENT_HEADER = 'H', FORMAT_DEFINITION = 'F', CATEGORY_DEFINITION = 'C', LOG_RECORD = 'R'
+    };
+
+    enum HeaderFlags : uint8_t
+    {
+        DATE_LOGGING = 1, TIME_LOGGING = 2
+    };
+
+    template <typename T>
+    inline void AppendValue(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    inline void AppendSegmentHeader(string& out, bool is_date_logging, bool is_time_logging) {
+        out += static_cast<char>(SEGMENT_HEADER);
+        out.append(kMagic, sizeof(kMagic));
+        AppendValue<uint8_t>(out, kVersion);
+        AppendValue<uint8_t>(out, (is_date_logging ? DATE_LOGGING : 0) | (is_time_logging ? TIME_LOGGING : 0));
+    }
+
+    inline void AppendFormatDefinition(string& out, uint32_t id, const char* format) {
+        uint32_t length = static_cast<uint32_t>(strlen(format));
+        out += static_cast<char>(FORMAT_DEFINITION);
+        AppendValue(out, id);
+        AppendValue(out, length);
+        out.append(format, length);
+    }
+
+    inline void AppendCategoryDefinition(string& out, uint16_t id, const string& name) {
+        uint32_t length = static_cast<uint32_t>(name.size());
+        out += static_cast<char>(CATEGORY_DEFINITION);
+        AppendValue(out, id);
+        AppendValue(out, length);
+        out.append(name);
+    }
+
+    inline void AppendRecord(string& out, uint8_t level, uint16_t category, int64_t timestamp, uint32_t format_id,
+                             const char* payload, uint32_t size) {
+        out += static_cast<char>(LOG_RECORD);
+        AppendValue(out, level);
+        AppendValue(out, category);
+        AppendValue(out, timestamp);
+        AppendValue(out, format_id);
+        AppendValue(out, size);
+        out.append(payload, size);
+    }
+
+    // Length of the complete records at the start of a memory-mapped
+    // segment, skipping the zero bytes a crash leaves in unused space.
+    size_t SegmentEnd(const char* data, size_t size);
+
+    // Calls on_record with the text line (ending in '\n') the logger would
+    // have written for each record of the segment. Returns false when the
+    // segment is not a binary log; a truncated last record (segment still
+    // being written) ends decoding silently.
+    bool DecodeSegment(gzFile file, const function<void(uint8_t level, int64_t timestamp, const string& line)>& on_record);
+}
+}
+#endif
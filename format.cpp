@@ -0,0 +1,149 @@
+#include "format.hpp"
+#include <charconv>
+#include <stdexcept>
+
+using namespace logger;
+
+mutex FormatRegistry::mutex_;
+unordered_map<const char*, uint32_t> FormatRegistry::ids_;
+atomic<const char**> FormatRegistry::chunks_[FormatRegistry::kMaxChunks];
+uint32_t FormatRegistry::next_id_ = 1;
+atomic<const char*> FormatRegistry::keys_[FormatRegistry::kTableSize];
+uint32_t FormatRegistry::values_[FormatRegistry::kTableSize];
+
+uint32_t FormatRegistry::Register(const char* format) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = ids_.find(format);
+    if (it != ids_.end())
+        return it->second;
+
+    uint32_t id = next_id_;
+    size_t chunk_index = id >> kChunkBits;
+    if (chunk_index >= kMaxChunks)
+        throw length_error("Too many logger format strings");
+    const char** chunk = chunks_[chunk_index].load(memory_order_relaxed);
+    if (!chunk) {
+        chunk = new const char*[kChunkSize]();
+        chunks_[chunk_index].store(chunk, memory_order_release);
+    }
+    chunk[id & (kChunkSize - 1)] = format;
+    ids_.emplace(format, id);
+    next_id_++;
+
+    size_t slot = Hash(format);
+    for (size_t probe = 0; probe < kMaxProbes; probe++, slot = (slot + 1) & (kTableSize - 1)) {
+        if (!keys_[slot].load(memory_order_relaxed)) {
+            values_[slot] = id;
+            keys_[slot].store(format, memory_order_release);
+            break;
+        }
+    }
+    return id;
+}
+
+const char* FormatRegistry::Get(uint32_t id) {
+    size_t chunk_index = id >> kChunkBits;
+    if (id == 0 || chunk_index >= kMaxChunks)
+        return nullptr;
+    const char** chunk = chunks_[chunk_index].load(memory_order_acquire);
+    return chunk ? chunk[id & (kChunkSize - 1)] : nullptr;
+}
+
+namespace {
+    template <typename T>
+    T ReadValue(const char* data) {
+        T value;
+        memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void AppendNumber(string& out, T value) {
+        char buffer[32];
+        auto result = to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr - buffer);
+    }
+
+    // Appends one argument and returns the number of bytes consumed, 0 when
+    // the remaining data does not hold a complete argument.
+    size_t AppendArg(const char* args, size_t size, string& out) {
+        if (size < 1)
+            return 0;
+        switch (static_cast<ArgType>(args[0])) {
+        case ARG_INT:
+            if (size < 1 + sizeof(int64_t))
+                return 0;
+            AppendNumber(out, ReadValue<int64_t>(args + 1));
+            return 1 + sizeof(int64_t);
+        case ARG_UINT:
+            if (size < 1 + sizeof(uint64_t))
+                return 0;
+            AppendNumber(out, ReadValue<uint64_t>(args + 1));
+            return 1 + sizeof(uint64_t);
+        case ARG_DOUBLE:
+            if (size < 1 + sizeof(double))
+                return 0;
+            AppendNumber(out, ReadValue<double>(args + 1));
+            return 1 + sizeof(double);
+        case ARG_FLOAT:
+            if (size < 1 + sizeof(float))
+                return 0;
+            AppendNumber(out, ReadValue<float>(args + 1));
+            return 1 + sizeof(float);
+        case ARG_BOOL:
+            if (size < 2)
+                return 0;
+            out += args[1] ? "true" : "false";
+            return 2;
+        case ARG_CHAR:
+            if (size < 2)
+                return 0;
+            out += args[1];
+            return 2;
+        case ARG_STRING: {
+            if (size < 1 + sizeof(uint32_t))
+                return 0;
+            uint32_t length = ReadValue<uint32_t>(args + 1);
+            if (size < 1 + sizeof(uint32_t) + length)
+                return 0;
+            out.append(args + 1 + sizeof(uint32_t), length);
+            return 1 + sizeof(uint32_t) + length;
+        }
+        case ARG_POINTER: {
+            if (size < 1 + sizeof(uint64_t))
+                return 0;
+            char buffer[24] = "0x";
+            auto result = to_chars(buffer + 2, buffer + sizeof(buffer), ReadValue<uint64_t>(args + 1), 16);
+            out.append(buffer, result.ptr - buffer);
+            return 1 + sizeof(uint64_t);
+        }
+        }
+        return 0;
+    }
+}
+
+void logger::FormatArgs(const char* format, const char* args, size_t size, string& out) {
+    if (!format)
+        return;
+    const char* literal = format;
+    const char* p = format;
+    while (*p) {
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+            out.append(literal, p + 1 - literal);
+            p += 2;
+            literal = p;
+        } else if (p[0] == '{' && p[1] == '}') {
+            out.append(literal, p - literal);
+            size_t consumed = AppendArg(args, size, out);
+            if (consumed == 0)
+                out += "{}";
+            args += consumed;
+            size -= consumed;
+            p += 2;
+            literal = p;
+        } else {
+            p++;
+        }
+    }
+    out.append(literal, p - literal);
+}
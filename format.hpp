@@ -0,0 +1,258 @@
+#ifndef _FORMAT_HPP_
+#define _FORMAT_HPP_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+
+namespace logger {
+    using namespace std;
+
+    // Process-wide table of static format strings. Ids are handed out once per
+    // call site; lookups by id never lock.
+    class FormatRegistry
+    {
+    public:
+        static uint32_t Register(const char* format);
+        static const char* Get(uint32_t id);
+
+        // Same id as Register, but found without locking once the pointer
+        // has been seen: an open-addressing table keyed by the pointer.
+        static uint32_t Intern(const char* format) {
+            size_t slot = Hash(format);
+            for (size_t probe = 0; probe < kMaxProbes; probe++, slot = (slot + 1) & (kTableSize - 1)) {
+                const char* key = keys_[slot].load(memory_order_acquire);
+                if (key == format)
+                    return values_[slot];
+                if (!key)
+                    break;
+            }
+            return Register(format);
+        }
+
+    private:
+        static constexpr size_t kTableSize = 16 * 1024;
+        static constexpr size_t kMaxProbes = 16;
+
+        static size_t Hash(const char* format) {
+            uintptr_t value = reinterpret_cast<uintptr_t>(format);
+            return ((value >> 3) * 0x9E3779B97F4A7C15ull >> 32) & (kTableSize - 1);
+        }
+
+        static atomic<const char*> keys_[kTableSize];
+        static uint32_t values_[kTableSize];
+
+        static constexpr size_t kChunkBits = 10;
+        static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+        static constexpr size_t kMaxChunks = 256;
+
+        static mutex mutex_;
+        static unordered_map<const char*, uint32_t> ids_;
+        static atomic<const char**> chunks_[kMaxChunks];
+        static uint32_t next_id_;
+    };
+
+    // Arguments are stored as a one byte type tag followed by the raw value;
+    // strings carry a 32-bit length in front of their bytes.
+    enum ArgType : uint8_t
+    {
+        ARG_INT = 1, ARG_UINT, ARG_DOUBLE, ARG_BOOL, ARG_CHAR, ARG_STRING, ARG_POINTER, ARG_FLOAT
+    };
+
+    template <typename T, typename Enable = void>
+    struct ArgEncoder;
+
+    template <typename T>
+    struct ArgEncoder<T, enable_if_t<is_integral_v<T> && is_signed_v<T> && !is_same_v<T, char>>>
+    {
+        static constexpr ArgType kType = ARG_INT;
+        static size_t Size(T) { return 1 + sizeof(int64_t); }
+        static char* Encode(char* out, T value) {
+            int64_t raw = value;
+            *out = kType;
+            memcpy(out + 1, &raw, sizeof(raw));
+            return out + 1 + sizeof(raw);
+        }
+    };
+
+    template <typename T>
+    struct ArgEncoder<T, enable_if_t<is_integral_v<T> && is_unsigned_v<T> && !is_same_v<T, bool> && !is_same_v<T, char>>>
+    {
+        static constexpr ArgType kType = ARG_UINT;
+        static size_t Size(T) { return 1 + sizeof(uint64_t); }
+        static char* Encode(char* out, T value) {
+            uint64_t raw = value;
+            *out = kType;
+            memcpy(out + 1, &raw, sizeof(raw));
+            return out + 1 + sizeof(raw);
+        }
+    };
+
+    template <>
+    struct ArgEncoder<float>
+    {
+        static constexpr ArgType kType = ARG_FLOAT;
+        static size_t Size(float) { return 1 + sizeof(float); }
+        static char* Encode(char* out, float value) {
+            *out = kType;
+            memcpy(out + 1, &value, sizeof(value));
+            return out + 1 + sizeof(value);
+        }
+    };
+
+    template <typename T>
+    struct ArgEncoder<T, enable_if_t<is_floating_point_v<T> && !is_same_v<T, float>>>
+    {
+        static constexpr ArgType kType = ARG_DOUBLE;
+        static size_t Size(T) { return 1 + sizeof(double); }
+        static char* Encode(char* out, T value) {
+            double raw = value;
+            *out = kType;
+            memcpy(out + 1, &raw, sizeof(raw));
+            return out + 1 + sizeof(raw);
+        }
+    };
+
+    template <>
+    struct ArgEncoder<bool>
+    {
+        static constexpr ArgType kType = ARG_BOOL;
+        static size_t Size(bool) { return 2; }
+        static char* Encode(char* out, bool value) {
+            out[0] = kType;
+            out[1] = value ? 1 : 0;
+            return out + 2;
+        }
+    };
+
+    template <>
+    struct ArgEncoder<char>
+    {
+        static constexpr ArgType kType = ARG_CHAR;
+        static size_t Size(char) { return 2; }
+        static char* Encode(char* out, char value) {
+            out[0] = kType;
+            out[1] = value;
+            return out + 2;
+        }
+    };
+
+    template <>
+    struct ArgEncoder<string_view>
+    {
+        static constexpr ArgType kType = ARG_STRING;
+        static size_t Size(string_view value) { return 1 + sizeof(uint32_t) + value.size(); }
+        static char* Encode(char* out, string_view value) {
+            uint32_t length = static_cast<uint32_t>(value.size());
+            *out = kType;
+            memcpy(out + 1, &length, sizeof(length));
+            memcpy(out + 1 + sizeof(length), value.data(), length);
+            return out + 1 + sizeof(length) + length;
+        }
+    };
+
+    template <>
+    struct ArgEncoder<string> : ArgEncoder<string_view> {};
+
+    template <>
+    struct ArgEncoder<const char*>
+    {
+        static constexpr ArgType kType = ARG_STRING;
+        static size_t Size(const char* value) { return ArgEncoder<string_view>::Size(value ? value : "(null)"); }
+        static char* Encode(char* out, const char* value) {
+            return ArgEncoder<string_view>::Encode(out, value ? value : "(null)");
+        }
+    };
+
+    template <>
+    struct ArgEncoder<char*> : ArgEncoder<const char*> {};
+
+    template <typename T>
+    struct ArgEncoder<T*, enable_if_t<!is_same_v<remove_cv_t<T>, char>>>
+    {
+        static constexpr ArgType kType = ARG_POINTER;
+        static size_t Size(const T*) { return 1 + sizeof(uint64_t); }
+        static char* Encode(char* out, const T* value) {
+            uint64_t raw = reinterpret_cast<uintptr_t>(value);
+            *out = kType;
+            memcpy(out + 1, &raw, sizeof(raw));
+            return out + 1 + sizeof(raw);
+        }
+    };
+
+    template <typename T>
+    using ArgEncoderFor = ArgEncoder<decay_t<T>>;
+
+    template <typename... Args>
+    size_t ArgsSize(const Args&... args) {
+        return (size_t(0) + ... + ArgEncoderFor<Args>::Size(args));
+    }
+
+    template <typename... Args>
+    char* EncodeArgs(char* out, const Args&... args) {
+        ((out = ArgEncoderFor<Args>::Encode(out, args)), ...);
+        return out;
+    }
+
+    template <typename T>
+    concept LoggableArg = requires(const T& value, char* out) {
+        ArgEncoderFor<T>::Size(value);
+        ArgEncoderFor<T>::Encode(out, value);
+    };
+
+    // Not constexpr on purpose: reaching it while checking a format string
+    // at compile time turns the check into a compile error.
+    inline void FormatStringError(const char*) {}
+
+    constexpr size_t CountPlaceholders(const char* format) {
+        size_t count = 0;
+        for (const char* p = format; *p; p++) {
+            if (p[0] == '{' && p[1] == '{') {
+                p++;
+            } else if (p[0] == '}' && p[1] == '}') {
+                p++;
+            } else if (p[0] == '{' && p[1] == '}') {
+                count++;
+                p++;
+            } else if (p[0] == '{' || p[0] == '}') {
+                FormatStringError("unmatched brace in log format string");
+            }
+        }
+        return count;
+    }
+
+    // Format string checked against the argument types at compile time. Only
+    // string literals are accepted: the logger thread formats the record later
+    // and needs the format to outlive the call.
+    template <typename... Args>
+    class BasicFormatString
+    {
+    public:
+        template <size_t N>
+        consteval BasicFormatString(const char (&format)[N]) : format_(format) {
+            static_assert((LoggableArg<Args> && ...), "Unsupported argument type for log format");
+            if (CountPlaceholders(format) != sizeof...(Args))
+                FormatStringError("number of {} placeholders does not match the number of arguments");
+        }
+
+        const char* Get() const {
+            return format_;
+        }
+
+    private:
+        const char* format_;
+    };
+
+    template <typename... Args>
+    using FormatString = BasicFormatString<type_identity_t<Args>...>;
+
+    // Replaces each "{}" in format with the next encoded argument; "{{" and
+    // "}}" produce literal braces. Placeholders without an argument are kept.
+    void FormatArgs(const char* format, const char* args, size_t size, string& out);
+}
+#endif
@@ -0,0 +1,188 @@
+// Writes the records of the "shm=<name>" loggers of all processes on the
+// host into one output. Every producer ring "<name>.<pid>.<id>" found in
+// /dev/shm is drained, the records are merged by timestamp and handed to a
+// Logger built from the given configuration, which formats, rotates and
+// archives as usual; records logged through a category are written under a
+// category of the same name. Records are held back for --delay milliseconds so that
+// rings drained a little later still merge in order. A ring whose producer
+// closed it or is gone is removed once it is drained. One collector per
+// name runs at a time; SIGINT or SIGTERM writes what is pending and exits.
+//
+// Usage: logcollector [--delay MS] <name> <config>
+//   e.g. logcollector app "file=/var/log/app.log,lev=8,date,time,trunc=64M,archive"
+#include "logger.hpp"
+#include <algorithm>
+#include <csignal>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace logger;
+
+namespace {
+    constexpr size_t kMaxBatch = 4096;
+    constexpr chrono::milliseconds kScanInterval{100};
+    constexpr chrono::milliseconds kIdleSleep{10};
+
+    volatile sig_atomic_t is_stopping = 0;
+
+    void Stop(int) {
+        is_stopping = 1;
+    }
+
+    bool IsRingName(const string& filename, const string& name) {
+        if (filename.size() <= name.size() + 1 || filename.compare(0, name.size() + 1, name + ".") != 0)
+            return false;
+        string ids = filename.substr(name.size() + 1);
+        size_t dot = ids.find('.');
+        return dot != string::npos && dot > 0 && dot + 1 < ids.size() && ids.find('.', dot + 1) == string::npos &&
+            ids.find_first_not_of("0123456789.") == string::npos;
+    }
+
+    struct RingState
+    {
+        unique_ptr<SharedRing> ring;
+        // Checked once per scan, not for every drain.
+        bool is_abandoned = false;
+    };
+
+    void ScanRings(const string& name, map<string, RingState>& rings) {
+        error_code error;
+        for (auto& entry : filesystem::directory_iterator("/dev/shm", error)) {
+            string filename = entry.path().filename().string();
+            if (!IsRingName(filename, name) || rings.count(filename))
+                continue;
+            // Still being set up by its producer when this returns nullptr.
+            if (unique_ptr<SharedRing> ring = SharedRing::Open(filename))
+                rings[filename].ring = move(ring);
+        }
+        for (auto& [filename, state] : rings)
+            state.is_abandoned = state.ring->IsAbandoned();
+    }
+
+    bool ParseOptions(int argc, char* argv[], int64_t& delay_ms, string& name, string& config) {
+        vector<string> arguments;
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--delay" && i + 1 < argc) {
+                try {
+                    delay_ms = stoll(argv[++i]);
+                } catch (exception&) {
+                    return false;
+                }
+            } else {
+                arguments.push_back(arg);
+            }
+        }
+        if (arguments.size() != 2 || arguments[0].empty() || arguments[0].find('/') != string::npos)
+            return false;
+        name = arguments[0];
+        config = arguments[1];
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int64_t delay_ms = 200;
+    string name;
+    string config;
+    if (!ParseOptions(argc, argv, delay_ms, name, config)) {
+        cerr << "Usage: " << argv[0] << " [--delay MS] <name> <config>" << endl;
+        return 2;
+    }
+
+    string lock_name = "/" + name + ".collector";
+    int lock_fd = shm_open(lock_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        cerr << name << ": another collector is running" << endl;
+        return 1;
+    }
+    // Removed on a clean exit; after a crash the next collector reuses it.
+    auto release_lock = [&] {
+        shm_unlink(lock_name.c_str());
+        close(lock_fd);
+    };
+    unique_ptr<Logger> output;
+    try {
+        output = make_unique<Logger>(config);
+    } catch (exception& e) {
+        cerr << e.what() << endl;
+        release_lock();
+        return 1;
+    }
+    signal(SIGINT, Stop);
+    signal(SIGTERM, Stop);
+
+    map<string, RingState> rings;
+    map<string, LogCategory> categories;
+    vector<SharedRing::Record> pending;
+    SharedRing::Record record;
+    auto by_time = [](const SharedRing::Record& a, const SharedRing::Record& b) {
+        return a.timestamp < b.timestamp;
+    };
+    auto next_scan = chrono::steady_clock::now();
+    while (true) {
+        bool is_final = is_stopping;
+        auto now = chrono::steady_clock::now();
+        if (now >= next_scan || is_final) {
+            ScanRings(name, rings);
+            next_scan = now + kScanInterval;
+        }
+
+        size_t drained_from = pending.size();
+        for (auto it = rings.begin(); it != rings.end();) {
+            RingState& state = it->second;
+            size_t count = 0;
+            while ((count < kMaxBatch || is_final) && state.ring->TryPop(record, state.is_abandoned)) {
+                pending.push_back(move(record));
+                count++;
+            }
+            if (state.is_abandoned && state.ring->Empty()) {
+                state.ring->Unlink();
+                it = rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        size_t drained = pending.size() - drained_from;
+
+        // Each ring is nearly in order already; the new records are sorted
+        // and merged into the ones held back.
+        stable_sort(pending.begin() + drained_from, pending.end(), by_time);
+        inplace_merge(pending.begin(), pending.begin() + drained_from, pending.end(), by_time);
+        SharedRing::Record cutoff;
+        cutoff.timestamp = is_final ? INT64_MAX : TimestampNow() - delay_ms * 1000000;
+        auto end = upper_bound(pending.begin(), pending.end(), cutoff, by_time);
+        for (auto it = pending.begin(); it != end; ++it) {
+            if (it->level < EMERGENCY || it->level > DEBUG)
+                continue;
+            LogLevel level = static_cast<LogLevel>(it->level);
+            if (it->category.empty()) {
+                output->LogRecord(level, it->timestamp, it->text);
+                continue;
+            }
+            auto category = categories.find(it->category);
+            if (category == categories.end()) {
+                try {
+                    category = categories.emplace(it->category, output->Category(it->category)).first;
+                } catch (errors::TooManyCategories&) {
+                    output->LogRecord(level, it->timestamp, it->text);
+                    continue;
+                }
+            }
+            category->second.LogRecord(level, it->timestamp, it->text);
+        }
+        pending.erase(pending.begin(), end);
+
+        if (is_final)
+            break;
+        if (drained == 0)
+            this_thread::sleep_for(kIdleSleep);
+    }
+    output.reset();
+    release_lock();
+    return 0;
+}
@@ -0,0 +1,43 @@
+// Converts binary log segments written with the "binary" option back into
+// the text lines the logger writes in text mode. Plain and gzipped
+// segments are both accepted.
+//
+// Usage: logdecode <segment>...
+#include "binary_log.hpp"
+#include "logger.hpp"
+
+using namespace logger;
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <segment>..." << endl;
+        return 2;
+    }
+
+    int result = 0;
+    string out;
+    for (int i = 1; i < argc; i++) {
+        gzFile file = gzopen(argv[i], "rb");
+        if (!file) {
+            cerr << argv[i] << ": cannot open" << endl;
+            result = 1;
+            continue;
+        }
+        gzbuffer(file, 256 * 1024);
+        bool is_decoded = binary::DecodeSegment(file, [&out](uint8_t, int64_t, const string& line) {
+            out += line;
+            if (out.size() >= 64 * 1024) {
+                fwrite(out.data(), 1, out.size(), stdout);
+                out.clear();
+            }
+        });
+        if (!is_decoded) {
+            cerr << argv[i] << ": not a binary log or corrupted segment" << endl;
+            result = 1;
+        }
+        gzclose(file);
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+    return result;
+}
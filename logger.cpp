@@ -1,63 +1,827 @@
 #include "logger.hpp"
+#include "binary_log.hpp"
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <csignal>
+#include <sstream>
+#include <unistd.h>
 
 using namespace logger;
 
-Logger::Logger(const string& config) {
-    LogConfig temp_config;
-    ConfigurationSetDefault(temp_config);
-    Configure(temp_config, config);
-    current_config_ = ConfigurationCheck(temp_config);
+atomic<uint64_t> Logger::next_logger_id_ = 1;
+atomic<Logger*> Logger::fatal_loggers_[Logger::kMaxFatalLoggers];
+atomic<size_t> Logger::next_counter_stripe_ = 0;
+
+namespace {
+    // Per-thread list of the queues this thread owns, keyed by logger id.
+    struct ThreadQueueCache
+    {
+        uint64_t last_logger_id = 0;
+        ThreadQueue* last_queue = nullptr;
+        vector<pair<uint64_t, shared_ptr<ThreadQueue>>> queues;
+
+        ~ThreadQueueCache() {
+            for (auto& entry : queues)
+                entry.second->is_producer_exited.store(true, memory_order_release);
+        }
+    };
+
+    thread_local ThreadQueueCache thread_queue_cache;
+
+    struct RepeatStateCache
+    {
+        vector<pair<uint64_t, shared_ptr<RepeatState>>> states;
+
+        ~RepeatStateCache() {
+            for (auto& entry : states)
+                entry.second->is_producer_exited.store(true, memory_order_release);
+        }
+    };
+
+    thread_local RepeatStateCache repeat_state_cache;
+
+    struct StreamBuffer
+    {
+        string text;
+        bool is_used = false;
+    };
+
+    thread_local StreamBuffer stream_buffer;
+
+    // Records a thread logged below the threshold of a logger with "flight",
+    // the oldest overwritten by new ones. Only the owning thread touches it,
+    // and the slots keep their spill buffers, so recording is a copy into
+    // the next slot.
+    struct FlightRecorder
+    {
+        uint64_t logger_id;
+        shared_ptr<const atomic_bool> is_logger_closed;
+        vector<Message> records = {};
+        size_t next = 0;
+        size_t count = 0;
+    };
+
+    thread_local vector<FlightRecorder> flight_recorders;
+
+    const int kFatalSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    struct sigaction previous_signal_actions[size(kFatalSignals)];
+    terminate_handler previous_terminate_handler = nullptr;
+}
+
+Logger::Logger(const string& config, vector<unique_ptr<Sink>> sinks) {
+    auto temp_config = make_unique<LogConfig>();
+    ConfigurationSetDefault(*temp_config);
+    Configure(*temp_config, config);
+    ConfigurationCheck(*temp_config);
+    config_.store(temp_config.get(), memory_order_release);
+    configs_.push_back(move(temp_config));
+    if (!Config().is_per_thread_queue)
+        messages_.reset(new RingBuffer<Message>(Config().queue_capacity));
+    if (!Config().shm_name.empty()) {
+        string name = Config().shm_name + "." + to_string(getpid()) + "." + to_string(logger_id_);
+        shared_ring_ = SharedRing::Create(name, Config().queue_capacity);
+        if (!shared_ring_)
+            throw errors::SharedMemoryNotOpened();
+    }
+    timestamp_formatter_.Configure(Config().is_date_logging, Config().is_time_logging);
+
+    if (IsArchiverNeeded(Config()))
+        archiver_.reset(new Archiver(Config().compression_level, Config().archive_queue_limit));
+    CreateSinks(Config(), sinks_);
+    for (auto& sink : sinks)
+        sinks_.push_back({move(sink), true});
+    UpdateThreshold();
+    next_stats_time_ = chrono::steady_clock::now() + chrono::seconds(Config().stats_interval_s);
     is_logger_running = true;
-    thread t([this] {
+    if (Config().is_fatal_flush) {
+        InstallFatalHandlers();
+        for (auto& slot : fatal_loggers_) {
+            Logger* empty = nullptr;
+            if (slot.compare_exchange_strong(empty, this))
+                break;
+        }
+    }
+    if (Config().is_shared_backend) {
+        PrepareConsumer();
+        backend_ = &Backend::Instance();
+        backend_->Register(this);
+        return;
+    }
+    logger_thread_ = thread([this] {
         LoggerThread();
     });
-    t.detach();
 }
 
 Logger::~Logger() {
-    while (!messages_.empty()) {
-        this_thread::sleep_for(chrono::seconds(3));
+    for (auto& slot : fatal_loggers_) {
+        Logger* self = this;
+        slot.compare_exchange_strong(self, nullptr);
+    }
+    if (backend_) {
+        is_logger_running = false;
+        backend_->Unregister(this);
+        DrainAll();
+        ReportRepeats(true);
+        ReportRateLimits(true);
+        FlushSinks();
+    } else {
+        {
+            lock_guard<mutex> lock(mutex_);
+            is_logger_running = false;
+        }
+        condition_variable_.notify_all();
+        logger_thread_.join();
+    }
+    if (shared_ring_)
+        shared_ring_->Close();
+    sinks_.clear();
+    {
+        lock_guard<mutex> lock(thread_queues_mutex_);
+        for (auto& queue : thread_queues_)
+            queue->is_logger_closed.store(true, memory_order_release);
     }
+    {
+        lock_guard<mutex> lock(repeat_states_mutex_);
+        for (auto& state : repeat_states_)
+            state->is_logger_closed.store(true, memory_order_release);
+    }
+    is_logger_closed_->store(true, memory_order_release);
+}
+
+void Logger::LogText(LogLevel level, string_view text, uint16_t category) {
+    if (!IsTextAccepted(level, text, category))
+        return;
+    Message message;
+    message.level = level;
+    message.category = category;
+    message.timestamp = TimestampNow();
+    message.SetText(text);
+    Log(message);
+}
 
-    is_logger_running = false;
-    condition_variable_.notify_all();
-    while (!is_logger_closed) {
-        this_thread::sleep_for(chrono::seconds(1));
+void Logger::LogText(LogLevel level, string&& text) {
+    if (!IsTextAccepted(level, text))
+        return;
+    Message message;
+    message.level = level;
+    message.timestamp = TimestampNow();
+    message.SetText(move(text));
+    Log(message);
+}
+
+bool Logger::IsTextAccepted(LogLevel level, string_view text, uint16_t category) {
+    if (!IsEnabled(level, category)) {
+        CountFiltered(level);
+        if (Message* record = NextFlightRecord()) {
+            record->level = level;
+            record->category = category;
+            record->timestamp = TimestampNow();
+            record->SetText(text);
+        }
+        return false;
     }
-    if (file_stream_.is_open())
-        file_stream_.close();
-    cout << "Logger closed!" << endl;
+    return !Config().is_coalescing || !IsRepeated(level, category, 0, text.data(), text.size());
 }
 
-void Logger::Log(Message message) {
-    lock_guard<mutex> lock(mutex_);
-    // cout << "Pushed" << endl;
-    messages_.push(message);
+// Decided before the record is copied into a Message: a run of identical
+// records from one thread becomes the first record plus a count, written
+// when the run ends or at least once per coalesce window.
+bool Logger::IsRepeated(LogLevel level, uint16_t category, uint32_t format_id, const char* data, size_t size) {
+    RepeatState& state = *GetRepeatState();
+    Message report;
+    bool is_report_due = false;
+    {
+        lock_guard<mutex> lock(state.state_mutex);
+        if (state.level == level && state.category == category && state.format_id == format_id &&
+            state.payload.size() == size && memcmp(state.payload.data(), data, size) == 0) {
+            if (state.repeats == 0)
+                state.first_repeat_time = TimestampNow();
+            state.repeats++;
+            GetCounterStripe().suppressed[level].fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        if (state.repeats > 0) {
+            EncodeRepeatReport(report, state);
+            is_report_due = true;
+        }
+        state.level = level;
+        state.category = category;
+        state.format_id = format_id;
+        state.payload.assign(data, size);
+    }
+    // Outside the lock: the consumer takes it to report runs, and Log() may
+    // wait for the consumer.
+    if (is_report_due)
+        Log(report);
+    return false;
+}
 
-    condition_variable_.notify_one();
+RepeatState* Logger::GetRepeatState() {
+    RepeatStateCache& cache = repeat_state_cache;
+    for (auto& entry : cache.states) {
+        if (entry.first == logger_id_)
+            return entry.second.get();
+    }
+
+    cache.states.erase(remove_if(cache.states.begin(), cache.states.end(), [](const auto& entry) {
+        return entry.second->is_logger_closed.load(memory_order_acquire);
+    }), cache.states.end());
+
+    auto state = make_shared<RepeatState>();
+    {
+        lock_guard<mutex> lock(repeat_states_mutex_);
+        repeat_states_.push_back(state);
+    }
+    next_repeat_report_time_.store(0, memory_order_relaxed);
+    cache.states.emplace_back(logger_id_, state);
+    return state.get();
+}
+
+// Called with the state's mutex held; the run starts over.
+void Logger::EncodeRepeatReport(Message& message, RepeatState& state) {
+    EncodeMessage(message, state.level, FormatRegistry::Intern("Last message repeated {} times"), state.repeats);
+    message.category = state.category;
+    state.repeats = 0;
+}
+
+// Consumer side, after the records queued before the repeats are written.
+// Forced on Flush() and shutdown; otherwise reports the runs whose window
+// has passed and those of exited threads, and drops the latter.
+void Logger::ReportRepeats(bool is_forced) {
+    int64_t now = TimestampNow();
+    int64_t window = Config().coalesce_window_s * 1000000000;
+    int64_t next_report_time = INT64_MAX;
+    Message report;
+    lock_guard<mutex> lock(repeat_states_mutex_);
+    for (auto it = repeat_states_.begin(); it != repeat_states_.end();) {
+        RepeatState& state = **it;
+        bool is_exited = state.is_producer_exited.load(memory_order_acquire);
+        {
+            lock_guard<mutex> state_lock(state.state_mutex);
+            if (state.repeats > 0 && (is_forced || is_exited || now - state.first_repeat_time >= window)) {
+                EncodeRepeatReport(report, state);
+                if (shared_ring_)
+                    LogToSharedRing(report);
+                else
+                    Log2(report);
+            }
+            if (state.repeats > 0)
+                next_report_time = min(next_report_time, state.first_repeat_time + window);
+        }
+        if (is_exited) {
+            it = repeat_states_.erase(it);
+        } else {
+            // A run that starts later is due a window after it starts.
+            next_report_time = min(next_report_time, now + window);
+            ++it;
+        }
+    }
+    next_repeat_report_time_.store(next_report_time, memory_order_relaxed);
+}
+
+void Logger::ReportRepeatsIfDue() {
+    if (TimestampNow() >= next_repeat_report_time_.load(memory_order_relaxed))
+        ReportRepeats(false);
+}
+
+bool Logger::IsWithinRate(uint16_t category, LogLevel level, RateLimiter& limiter, const char* file, int line) {
+    uint64_t suppressed = 0;
+    if (!limiter.TryAcquire(suppressed)) {
+        GetCounterStripe().suppressed[level].fetch_add(1, memory_order_relaxed);
+        // First refusal since the count was last reported.
+        if (suppressed == 1) {
+            lock_guard<mutex> lock(rate_limits_mutex_);
+            rate_limits_.push_back({&limiter, level, category, file, line, suppressed});
+            if (next_rate_report_time_.load(memory_order_relaxed) == INT64_MAX)
+                next_rate_report_time_.store(TimestampNow() + kRateReportInterval, memory_order_relaxed);
+        }
+        return false;
+    }
+    if (suppressed > 0)
+        EnqueueFormat(category, level, FormatRegistry::Intern("{} records suppressed by the rate limit at {}:{}"), suppressed, file, line);
+    return true;
+}
+
+// Consumer side: reports the count of a call site once it stopped growing
+// for an interval, or at once on Flush() and shutdown. A count already
+// taken by an admitted record is dropped.
+void Logger::ReportRateLimits(bool is_forced) {
+    Message report;
+    lock_guard<mutex> lock(rate_limits_mutex_);
+    for (auto it = rate_limits_.begin(); it != rate_limits_.end();) {
+        uint64_t suppressed = it->limiter->Suppressed();
+        if (suppressed != 0 && !is_forced && suppressed != it->last_suppressed) {
+            it->last_suppressed = suppressed;
+            ++it;
+            continue;
+        }
+        suppressed = suppressed ? it->limiter->TakeSuppressed() : 0;
+        if (suppressed > 0) {
+            EncodeMessage(report, it->level, FormatRegistry::Intern("{} records suppressed by the rate limit at {}:{}"),
+                          suppressed, it->file, it->line);
+            report.category = it->category;
+            if (shared_ring_)
+                LogToSharedRing(report);
+            else
+                Log2(report);
+        }
+        it = rate_limits_.erase(it);
+    }
+    next_rate_report_time_.store(rate_limits_.empty() ? INT64_MAX : TimestampNow() + kRateReportInterval,
+                                 memory_order_relaxed);
+}
+
+void Logger::ReportRateLimitsIfDue() {
+    if (TimestampNow() >= next_rate_report_time_.load(memory_order_relaxed))
+        ReportRateLimits(false);
+}
+
+Message* Logger::NextFlightRecord() {
+    size_t capacity = Config().flight_records;
+    if (capacity == 0)
+        return nullptr;
+    FlightRecorder* recorder = nullptr;
+    for (auto& candidate : flight_recorders) {
+        if (candidate.logger_id == logger_id_)
+            recorder = &candidate;
+    }
+    if (!recorder) {
+        flight_recorders.erase(remove_if(flight_recorders.begin(), flight_recorders.end(), [](const auto& candidate) {
+            return candidate.is_logger_closed->load(memory_order_acquire);
+        }), flight_recorders.end());
+        flight_recorders.push_back({logger_id_, is_logger_closed_});
+        recorder = &flight_recorders.back();
+    }
+    // First use, or "flight" changed by Reconfigure().
+    if (recorder->records.size() != capacity) {
+        recorder->records.assign(capacity, Message());
+        recorder->next = 0;
+        recorder->count = 0;
+    }
+    Message* record = &recorder->records[recorder->next];
+    recorder->next = (recorder->next + 1) % capacity;
+    recorder->count = min(recorder->count + 1, capacity);
+    return record;
+}
+
+// The recorded records go into the queue ahead of the trigger record, oldest
+// first, with the timestamps they were logged at.
+void Logger::ReplayFlightRecords() {
+    for (auto& recorder : flight_recorders) {
+        if (recorder.logger_id != logger_id_ || recorder.count == 0)
+            continue;
+        size_t capacity = recorder.records.size();
+        size_t first = (recorder.next + capacity - recorder.count) % capacity;
+        for (size_t i = 0; i < recorder.count; i++) {
+            Message& record = recorder.records[(first + i) % capacity];
+            record.is_flight_record = true;
+            Log(record);
+            record.is_flight_record = false;
+        }
+        recorder.count = 0;
+    }
+}
+
+void Logger::LogRecord(uint16_t category, LogLevel level, int64_t timestamp, string_view text) {
+    if (!IsEnabled(level, category)) {
+        CountFiltered(level);
+        return;
+    }
+    Message message;
+    message.level = level;
+    message.category = category;
+    message.timestamp = timestamp;
+    message.SetText(text);
+    Log(message);
+}
+
+void Logger::Log(Message& message) {
+    if (message.level <= Config().flight_trigger_level && !message.is_flight_record && Config().flight_records > 0)
+        ReplayFlightRecords();
+    if (shared_ring_) {
+        LogToSharedRing(message);
+        return;
+    }
+    if (Config().is_per_thread_queue) {
+        LogToThreadQueue(message);
+        return;
+    }
+    LogLevel level = message.level;
+    if (!messages_->TryPush(message)) {
+        switch (Config().overflow_policy) {
+        case DROP_NEWEST:
+            GetCounterStripe().dropped[level].fetch_add(1, memory_order_relaxed);
+            return;
+        case OVERWRITE_OLDEST: {
+            Message oldest;
+            while (!messages_->TryPush(message)) {
+                if (messages_->TryPop(oldest))
+                    GetCounterStripe().dropped[oldest.level].fetch_add(1, memory_order_relaxed);
+            }
+            break;
+        }
+        case BLOCK:
+        default:
+            while (!messages_->TryPush(message)) {
+                WakeLoggerThread(messages_->Size());
+                this_thread::yield();
+            }
+            break;
+        }
+    }
+    GetCounterStripe().accepted[level].fetch_add(1, memory_order_relaxed);
+    WakeLoggerThread(messages_->Size());
+}
+
+// Only the logger thread pops from a thread queue, so overwrite falls back
+// to dropping the newest record.
+void Logger::LogToThreadQueue(Message& message) {
+    ThreadQueue* queue = GetThreadQueue();
+    LogLevel level = message.level;
+    if (!queue->messages.TryPush(message)) {
+        if (Config().overflow_policy != BLOCK) {
+            GetCounterStripe().dropped[level].fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        while (!queue->messages.TryPush(message)) {
+            WakeLoggerThread(queue->messages.Size());
+            this_thread::yield();
+        }
+    }
+    GetCounterStripe().accepted[level].fetch_add(1, memory_order_relaxed);
+    WakeLoggerThread(queue->messages.Size());
+}
+
+// Never waits for the collector: a full ring drops the record whatever the
+// overflow policy. Format ids mean nothing to another process, so formatted
+// records are turned into text here.
+void Logger::LogToSharedRing(const Message& message) {
+    thread_local string formatted;
+    string_view text(message.PayloadData(), message.PayloadSize());
+    if (message.format_id != 0) {
+        formatted.clear();
+        try {
+            FormatArgs(FormatRegistry::Get(message.format_id), message.PayloadData(), message.PayloadSize(), formatted);
+        } catch (exception& e) {
+            cerr << "Logger error occured: " << e.what() << endl;
+            return;
+        }
+        text = formatted;
+    }
+    string_view category = message.category ? string_view(categories_[message.category - 1]->name) : string_view();
+    if (shared_ring_->TryPush(message.level, message.timestamp, category, text))
+        GetCounterStripe().accepted[message.level].fetch_add(1, memory_order_relaxed);
+    else
+        GetCounterStripe().dropped[message.level].fetch_add(1, memory_order_relaxed);
+}
+
+ThreadQueue* Logger::GetThreadQueue() {
+    ThreadQueueCache& cache = thread_queue_cache;
+    if (cache.last_logger_id == logger_id_)
+        return cache.last_queue;
+
+    for (auto& entry : cache.queues) {
+        if (entry.first == logger_id_) {
+            cache.last_logger_id = logger_id_;
+            cache.last_queue = entry.second.get();
+            return cache.last_queue;
+        }
+    }
+
+    cache.queues.erase(remove_if(cache.queues.begin(), cache.queues.end(), [](const auto& entry) {
+        return entry.second->is_logger_closed.load(memory_order_acquire);
+    }), cache.queues.end());
+
+    auto queue = make_shared<ThreadQueue>(Config().queue_capacity);
+    {
+        lock_guard<mutex> lock(thread_queues_mutex_);
+        thread_queues_.push_back(queue);
+        thread_queues_version_.fetch_add(1, memory_order_release);
+    }
+    cache.queues.emplace_back(logger_id_, queue);
+    cache.last_logger_id = logger_id_;
+    cache.last_queue = queue.get();
+    return cache.last_queue;
+}
+
+void Logger::WakeLoggerThread(size_t pending) {
+    size_t max_depth = max_queue_depth_.load(memory_order_relaxed);
+    while (pending > max_depth && !max_queue_depth_.compare_exchange_weak(max_depth, pending, memory_order_relaxed)) {
+    }
+    if (backend_) {
+        backend_->Wake();
+        return;
+    }
+    // Pairs with the fence in WaitForMessages: either the consumer sees the new
+    // message before sleeping, or we see it asleep and take the mutex.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (is_logger_thread_sleeping.load(memory_order_relaxed) &&
+        pending >= wake_threshold_.load(memory_order_relaxed)) {
+        lock_guard<mutex> lock(mutex_);
+        condition_variable_.notify_one();
+    }
+}
+
+// Logger thread only. A queue registered since the last refresh counts as
+// pending so that the thread wakes up and picks it up.
+size_t Logger::PendingMessages() {
+    if (!Config().is_per_thread_queue)
+        return messages_->Size();
+    if (thread_queues_version_.load(memory_order_acquire) != consumer_queues_version_)
+        return SIZE_MAX;
+    size_t pending = 0;
+    for (auto& queue : consumer_queues_)
+        pending += queue->messages.Size();
+    return pending;
+}
+
+bool Logger::HasPendingMessages() {
+    if (!Config().is_per_thread_queue)
+        return !messages_->Empty();
+    lock_guard<mutex> lock(thread_queues_mutex_);
+    for (auto& queue : thread_queues_) {
+        if (!queue->messages.Empty())
+            return true;
+    }
+    return false;
 }
 
 void Logger::LoggerThread() {
-    cout << "Logger started in thread: " << this_thread::get_id() << endl;
+    PrepareConsumer();
+    vector<Message>& batch = consumer_batch_;
     while (true) {
-        // chrono::steady_clock::time_point deadline = 
-        //     chrono::steady_clock::now() + std::chrono::seconds(10); как вариант через 10 секунд без сообщений гасить поток
+        uint64_t flush_requested = flush_requested_.load(memory_order_acquire);
+        if (flush_requested != flush_completed_.load(memory_order_relaxed)) {
+            DrainAll();
+            ReportRepeats(true);
+            ReportRateLimits(true);
+            FlushSinks();
+            ApplyPendingConfig();
+            CompleteFlush(flush_requested);
+            continue;
+        }
+        LogStatsIfDue();
+        ReportRepeatsIfDue();
+        ReportRateLimitsIfDue();
+
+        DrainBatch(batch);
+        if (!batch.empty() && batch.size() < Config().batch_size && Config().batch_delay_ms > 0) {
+            WaitForMessages(Config().batch_size - batch.size(), Config().batch_delay_ms);
+            DrainBatch(batch);
+        }
 
-        unique_lock<mutex> lock(mutex_);
-        // condition_variable_.wait_until(lock, deadline, [this] { return !messages_.empty() || !is_logger_running; });
-        condition_variable_.wait(lock, [this] { return !messages_.empty() || !is_logger_running; });
+        if (!batch.empty()) {
+            LogBatch(batch);
+            batch.clear();
+            continue;
+        }
+        if (is_merge_held_back_) {
+            this_thread::sleep_for(kMergeGrace);
+            continue;
+        }
 
+        WaitForMessages(1, WaitTimeout());
+        for (auto& entry : sinks_) {
+            if (entry.sink->FlushTimeout() == 0)
+                entry.sink->Flush();
+        }
         if (!is_logger_running) {
             break;
         }
+    }
+    // Records enqueued while the last batch was written are still queued.
+    DrainAll();
+    ReportRepeats(true);
+    ReportRateLimits(true);
+    FlushSinks();
+}
+
+void Logger::PrepareConsumer() {
+    consumer_batch_.reserve(Config().batch_size);
+}
+
+// One step of the consumer for the shared backend: handles at most one
+// batch and reports in timeout_ms when buffered records are due (0: none).
+bool Logger::ProcessBatch(unsigned int& timeout_ms) {
+    uint64_t flush_requested = flush_requested_.load(memory_order_acquire);
+    if (flush_requested != flush_completed_.load(memory_order_relaxed)) {
+        DrainAll();
+        ReportRepeats(true);
+        ReportRateLimits(true);
+        FlushSinks();
+        ApplyPendingConfig();
+        CompleteFlush(flush_requested);
+        timeout_ms = WaitTimeout();
+        return true;
+    }
+    LogStatsIfDue();
+    ReportRepeatsIfDue();
+    ReportRateLimitsIfDue();
+
+    bool is_work_done = false;
+    DrainBatch(consumer_batch_);
+    if (!consumer_batch_.empty()) {
+        LogBatch(consumer_batch_);
+        consumer_batch_.clear();
+        is_work_done = true;
+    } else {
+        for (auto& entry : sinks_) {
+            if (entry.sink->FlushTimeout() == 0)
+                entry.sink->Flush();
+        }
+    }
+    timeout_ms = is_merge_held_back_ ? 1 : WaitTimeout();
+    return is_work_done;
+}
+
+void Logger::DrainBatch(vector<Message>& batch, bool is_hold_back_allowed) {
+    if (Config().is_per_thread_queue) {
+        DrainThreadQueues(batch, is_hold_back_allowed);
+        return;
+    }
+    Message message;
+    while (batch.size() < Config().batch_size && messages_->TryPop(message)) {
+        batch.push_back(move(message));
+    }
+}
+
+// Merges the heads of all thread queues by timestamp. A producer takes its
+// timestamp a moment before the record becomes visible, so records younger
+// than kMergeGrace are held back until the next pass; otherwise a late
+// push could land behind records that are newer than it.
+void Logger::DrainThreadQueues(vector<Message>& batch, bool is_hold_back_allowed) {
+    RefreshThreadQueues();
 
-        Message message = messages_.front();
-        messages_.pop();
+    int64_t cutoff = TimestampNow() - chrono::duration_cast<chrono::nanoseconds>(kMergeGrace).count();
+    auto later = [](const pair<int64_t, size_t>& a, const pair<int64_t, size_t>& b) { return a.first > b.first; };
+    merge_heap_.clear();
+    for (size_t i = 0; i < consumer_queues_.size(); i++) {
+        Message* front = consumer_queues_[i]->messages.Front();
+        if (front)
+            merge_heap_.emplace_back(front->timestamp, i);
+    }
+    make_heap(merge_heap_.begin(), merge_heap_.end(), later);
+
+    while (!merge_heap_.empty() && batch.size() < Config().batch_size) {
+        if (merge_heap_.front().first > cutoff && is_logger_running && is_hold_back_allowed)
+            break;
+        pop_heap(merge_heap_.begin(), merge_heap_.end(), later);
+        size_t index = merge_heap_.back().second;
+        merge_heap_.pop_back();
 
-        Log2(message.level, message.message);
+        SpscQueue<Message>& queue = consumer_queues_[index]->messages;
+        batch.push_back(move(*queue.Front()));
+        queue.Pop();
+
+        Message* front = queue.Front();
+        if (front) {
+            merge_heap_.emplace_back(front->timestamp, index);
+            push_heap(merge_heap_.begin(), merge_heap_.end(), later);
+        }
+    }
+    is_merge_held_back_ = !merge_heap_.empty();
+}
+
+// Logs the records queued when it is called. Records enqueued meanwhile are
+// left for the normal loop, so busy producers can not keep it going.
+void Logger::DrainAll() {
+    RefreshThreadQueues();
+    size_t pending = PendingMessages();
+    vector<Message>& batch = consumer_batch_;
+    while (pending > 0) {
+        DrainBatch(batch, false);
+        if (batch.empty()) {
+            // A producer may still be publishing a slot it has claimed.
+            if (PendingMessages() == 0)
+                break;
+            this_thread::yield();
+            continue;
+        }
+        pending -= min(pending, batch.size());
+        LogBatch(batch);
+        batch.clear();
     }
-    cout << "Logger thread closed!" << endl;
-    is_logger_closed = true;
+}
+
+// Settings that shape the queues or the output format stay as they were
+// created; the rest takes effect once the records already queued are
+// written with the old sinks.
+void Logger::Reconfigure(const string& config) {
+    lock_guard<mutex> reconfigure_lock(reconfigure_mutex_);
+    auto temp_config = make_unique<LogConfig>();
+    ConfigurationSetDefault(*temp_config);
+    Configure(*temp_config, config);
+    const LogConfig& old_config = Config();
+    temp_config->queue_capacity = old_config.queue_capacity;
+    temp_config->is_per_thread_queue = old_config.is_per_thread_queue;
+    temp_config->is_shared_backend = old_config.is_shared_backend;
+    temp_config->is_binary_logging = old_config.is_binary_logging;
+    temp_config->is_fatal_flush = old_config.is_fatal_flush;
+    temp_config->archive_queue_limit = old_config.archive_queue_limit;
+    temp_config->shm_name = old_config.shm_name;
+    ConfigurationCheck(*temp_config);
+
+    // Producers may still read an old snapshot, so snapshots are only
+    // freed with the logger.
+    pending_config_.store(temp_config.get(), memory_order_release);
+    configs_.push_back(move(temp_config));
+    Flush();
+    if (reconfigure_error_)
+        rethrow_exception(exchange(reconfigure_error_, nullptr));
+}
+
+// Logger thread only, after the queued records were written.
+void Logger::ApplyPendingConfig() {
+    const LogConfig* config = pending_config_.exchange(nullptr, memory_order_acquire);
+    if (!config)
+        return;
+    vector<SinkEntry> sinks;
+    try {
+        if (IsArchiverNeeded(*config) && !archiver_) {
+            lock_guard<mutex> lock(sinks_mutex_);
+            archiver_.reset(new Archiver(config->compression_level, config->archive_queue_limit));
+        }
+        CreateSinks(*config, sinks);
+    } catch (...) {
+        reconfigure_error_ = current_exception();
+        return;
+    }
+    for (auto& entry : sinks_) {
+        if (entry.is_custom)
+            sinks.push_back(move(entry));
+    }
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        for (auto& entry : sinks_) {
+            if (!entry.sink)
+                continue;
+            Sink::Stats sink_stats = entry.sink->GetStats();
+            retired_sink_stats_.bytes_written += sink_stats.bytes_written;
+            retired_sink_stats_.flushes += sink_stats.flushes;
+            retired_sink_stats_.rotations += sink_stats.rotations;
+        }
+        sinks_.swap(sinks);
+    }
+    // The old sinks close their files outside the lock.
+    sinks.clear();
+
+    timestamp_formatter_.Configure(config->is_date_logging, config->is_time_logging);
+    consumer_batch_.reserve(config->batch_size);
+    next_stats_time_ = chrono::steady_clock::now() + chrono::seconds(config->stats_interval_s);
+    config_.store(config, memory_order_release);
+    UpdateThreshold();
+}
+
+void Logger::CompleteFlush(uint64_t flush_requested) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        flush_completed_.store(flush_requested, memory_order_release);
+    }
+    flush_condition_variable_.notify_all();
+}
+
+void Logger::Flush() {
+    uint64_t flush_requested = flush_requested_.fetch_add(1, memory_order_acq_rel) + 1;
+    if (backend_)
+        backend_->Wake();
+    unique_lock<mutex> lock(mutex_);
+    condition_variable_.notify_one();
+    flush_condition_variable_.wait(lock, [this, flush_requested] {
+        return flush_completed_.load(memory_order_acquire) >= flush_requested;
+    });
+}
+
+void Logger::RefreshThreadQueues() {
+    bool is_exited_found = false;
+    for (auto& queue : consumer_queues_) {
+        if (queue->is_producer_exited.load(memory_order_acquire) && queue->messages.Empty()) {
+            is_exited_found = true;
+            break;
+        }
+    }
+    if (!is_exited_found && thread_queues_version_.load(memory_order_acquire) == consumer_queues_version_)
+        return;
+
+    lock_guard<mutex> lock(thread_queues_mutex_);
+    thread_queues_.erase(remove_if(thread_queues_.begin(), thread_queues_.end(), [](const auto& queue) {
+        return queue->is_producer_exited.load(memory_order_acquire) && queue->messages.Empty();
+    }), thread_queues_.end());
+    consumer_queues_ = thread_queues_;
+    consumer_queues_version_ = thread_queues_version_.load(memory_order_acquire);
+}
+
+void Logger::WaitForMessages(size_t count, unsigned int timeout_ms) {
+    unique_lock<mutex> lock(mutex_);
+    wake_threshold_.store(count, memory_order_relaxed);
+    is_logger_thread_sleeping.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    auto ready = [this, count] { return PendingMessages() >= count || !is_logger_running || IsFlushRequested(); };
+    if (timeout_ms > 0)
+        condition_variable_.wait_for(lock, chrono::milliseconds(timeout_ms), ready);
+    else
+        condition_variable_.wait(lock, ready);
+    is_logger_thread_sleeping.store(false, memory_order_relaxed);
 }
 
 LogLevel& Logger::SetLogLevel(LogLevel& current_level, const int i) {
@@ -82,8 +846,10 @@ void Logger::Configure(LogConfig& temp_config, const string& config_string) {
             key = token.substr(0, equalsPos);
             value = token.substr(equalsPos + 1);
         }
-        else
+        else {
             key = token;
+            value = "";
+        }
 
         if (key == "file") {
             temp_config.path_to_log_file = value;
@@ -95,7 +861,7 @@ void Logger::Configure(LogConfig& temp_config, const string& config_string) {
             try {
                 SetLogLevel(temp_config.current_log_level, stoi(value)); 
             } catch (exception& e) {
-                cout << e.what() << ", current level is now EMERGENCY\n";
+                cerr << e.what() << ", current level is now EMERGENCY\n";
                 temp_config.current_log_level = EMERGENCY;
             }
         } else if (key == "date") {
@@ -104,30 +870,234 @@ void Logger::Configure(LogConfig& temp_config, const string& config_string) {
             temp_config.is_time_logging = true;
         } else if (key == "trunc") {
             if (!temp_config.is_logging_to_file) {
-                cout << "Logging into iostream, size control will be ignored!" << endl;
+                cerr << "Logging into iostream, size control will be ignored!" << endl;
                 continue;
             }
-            size_t size = stoi(value);
-            size_t unit_pos = value.find_last_not_of("0123456789");
-            string unit = "";
-            if (unit_pos <= value.size())
-                unit = value.substr(unit_pos);
-
-            if (unit == "K") {
-                temp_config.file_size_limit = size * 1024;
-            } else if (unit == "M") {
-                temp_config.file_size_limit = size * 1024 * 1024;
-            } else {
-                temp_config.file_size_limit = size;
-            }
+            temp_config.file_size_limit = ParseSize(value);
         } else if (key == "archive") {
             if (!temp_config.is_logging_to_file) {
-                cout << "Logging into iostream, archivating will be ignored!" << endl;
+                cerr << "Logging into iostream, archivating will be ignored!" << endl;
                 continue;
             }
             temp_config.is_file_needed_to_archivate = true;
+        } else if (key == "queue") {
+            temp_config.queue_capacity = ParseSize(value);
+            if (temp_config.queue_capacity == 0) {
+                cerr << "Queue capacity can not be zero, using default" << endl;
+                temp_config.queue_capacity = 8192;
+            }
+        } else if (key == "overflow") {
+            if (value == "block") {
+                temp_config.overflow_policy = BLOCK;
+            } else if (value == "drop") {
+                temp_config.overflow_policy = DROP_NEWEST;
+            } else if (value == "overwrite") {
+                temp_config.overflow_policy = OVERWRITE_OLDEST;
+            } else {
+                cerr << "Unknown overflow policy \"" << value << "\", current policy is now block\n";
+                temp_config.overflow_policy = BLOCK;
+            }
+        } else if (key == "batch") {
+            temp_config.batch_size = ParseSize(value);
+        } else if (key == "delay") {
+            temp_config.batch_delay_ms = stoi(value);
+        } else if (key == "gzlev") {
+            temp_config.compression_level = stoi(value);
+            if (temp_config.compression_level < 0 || temp_config.compression_level > 9) {
+                cerr << "Invalid compression level, using default\n";
+                temp_config.compression_level = Z_DEFAULT_COMPRESSION;
+            }
+        } else if (key == "archmax") {
+            temp_config.archive_queue_limit = ParseSize(value);
+        } else if (key == "binary") {
+            temp_config.is_binary_logging = true;
+        } else if (key == "perthread") {
+            temp_config.is_per_thread_queue = true;
+        } else if (key == "backend") {
+            temp_config.is_shared_backend = true;
+        } else if (key == "fatalflush") {
+            temp_config.is_fatal_flush = true;
+        } else if (key == "stats") {
+            temp_config.stats_interval_s = ParseDuration(value);
+        } else if (key == "coalesce") {
+            temp_config.is_coalescing = true;
+            if (!value.empty())
+                temp_config.coalesce_window_s = ParseDuration(value);
+        } else if (key == "buffer") {
+            temp_config.buffer_size = ParseSize(value);
+        } else if (key == "flush") {
+            temp_config.flush_interval_ms = stoi(value);
+        } else if (key == "flushlev") {
+            try {
+                SetLogLevel(temp_config.flush_level, stoi(value));
+            } catch (exception& e) {
+                cerr << e.what() << ", flush level is now ERROR\n";
+                temp_config.flush_level = ERROR;
+            }
+        } else if (key == "mmap") {
+            if (!temp_config.is_logging_to_file) {
+                cerr << "Logging into iostream, memory mapping will be ignored!" << endl;
+                continue;
+            }
+            temp_config.is_memory_mapped = true;
+        } else if (key == "msync") {
+            temp_config.msync_interval_ms = stoi(value);
+        } else if (key == "gzip") {
+            if (!temp_config.is_logging_to_file) {
+                cerr << "Logging into iostream, compression will be ignored!" << endl;
+                continue;
+            }
+            temp_config.is_compressed = true;
+        } else if (key == "rotate") {
+            temp_config.rotate_interval_s = ParseDuration(value);
+        } else if (key == "keep") {
+            temp_config.retention_files = ParseSize(value);
+        } else if (key == "keepsize") {
+            temp_config.retention_bytes = ParseSize(value);
+        } else if (key == "keepage") {
+            temp_config.retention_age_s = ParseDuration(value);
+        } else if (key == "index") {
+            temp_config.is_indexed = true;
+        } else if (key == "flight") {
+            size_t size = ParseSize(value);
+            temp_config.flight_records = size > 0 ? max<size_t>(1, size / sizeof(Message)) : 0;
+        } else if (key == "trigger") {
+            try {
+                SetLogLevel(temp_config.flight_trigger_level, stoi(value));
+            } catch (exception& e) {
+                cerr << e.what() << ", trigger level is now ERROR\n";
+                temp_config.flight_trigger_level = ERROR;
+            }
+        } else if (key == "shm") {
+            temp_config.shm_name = value;
+        } else if (key == "cat") {
+            size_t colon_pos = value.rfind(':');
+            try {
+                if (colon_pos == string::npos || colon_pos == 0)
+                    throw errors::InvalidLogLevel();
+                LogLevel level;
+                SetLogLevel(level, stoi(value.substr(colon_pos + 1)));
+                temp_config.category_levels.emplace_back(value.substr(0, colon_pos), level);
+            } catch (exception& e) {
+                cerr << e.what() << ", category level \"" << value << "\" is ignored\n";
+            }
+        } else if (key == "sink") {
+            SinkConfig sink_config = GetPrimarySinkConfig(temp_config);
+            ConfigureSink(sink_config, value);
+            temp_config.extra_sinks.push_back(sink_config);
+        }
+    }
+}
+
+// Additional sink: "sink=TYPE[:PATH][;OPTION...]", where TYPE is "std" or
+// "file" and the options are lev, buffer, flush, flushlev, trunc, archive,
+// mmap, msync, gzip, rotate, keep, keepsize, keepage and index with the same meaning as
+// for the main output. Options left out are taken from the keys given
+// before the sink; the file options start out unset.
+void Logger::ConfigureSink(SinkConfig& sink_config, const string& spec) {
+    istringstream iss(spec);
+    string token;
+    getline(iss, token, ';');
+    size_t colon_pos = token.find(':');
+    string type = token.substr(0, colon_pos);
+    if (type == "file") {
+        if (colon_pos == string::npos || colon_pos + 1 == token.size())
+            throw errors::InvalidLogPath();
+        sink_config.is_logging_to_file = true;
+        sink_config.path_to_log_file = token.substr(colon_pos + 1);
+    } else {
+        if (type != "std")
+            cerr << "Unknown sink type \"" << type << "\", using std\n";
+        sink_config.is_logging_to_file = false;
+        sink_config.path_to_log_file = "";
+    }
+    sink_config.file_size_limit = 0;
+    sink_config.is_file_needed_to_archivate = false;
+    sink_config.is_memory_mapped = false;
+    sink_config.rotate_interval_s = 0;
+    sink_config.retention_files = 0;
+    sink_config.retention_bytes = 0;
+    sink_config.retention_age_s = 0;
+    sink_config.is_compressed = false;
+    sink_config.is_indexed = false;
+
+    while (getline(iss, token, ';')) {
+        size_t equals_pos = token.find('=');
+        string key = token.substr(0, equals_pos);
+        string value = equals_pos == string::npos ? "" : token.substr(equals_pos + 1);
+        if (key == "lev") {
+            try {
+                SetLogLevel(sink_config.log_level, stoi(value));
+            } catch (exception& e) {
+                cerr << e.what() << ", sink level is now EMERGENCY\n";
+                sink_config.log_level = EMERGENCY;
+            }
+        } else if (key == "buffer") {
+            sink_config.buffer_size = ParseSize(value);
+        } else if (key == "flush") {
+            sink_config.flush_interval_ms = stoi(value);
+        } else if (key == "flushlev") {
+            try {
+                SetLogLevel(sink_config.flush_level, stoi(value));
+            } catch (exception& e) {
+                cerr << e.what() << ", sink flush level is now ERROR\n";
+                sink_config.flush_level = ERROR;
+            }
+        } else if (key == "trunc" && sink_config.is_logging_to_file) {
+            sink_config.file_size_limit = ParseSize(value);
+        } else if (key == "archive" && sink_config.is_logging_to_file) {
+            sink_config.is_file_needed_to_archivate = true;
+        } else if (key == "mmap" && sink_config.is_logging_to_file) {
+            sink_config.is_memory_mapped = true;
+        } else if (key == "gzip" && sink_config.is_logging_to_file) {
+            sink_config.is_compressed = true;
+        } else if (key == "msync") {
+            sink_config.msync_interval_ms = stoi(value);
+        } else if (key == "rotate") {
+            sink_config.rotate_interval_s = ParseDuration(value);
+        } else if (key == "keep") {
+            sink_config.retention_files = ParseSize(value);
+        } else if (key == "keepsize") {
+            sink_config.retention_bytes = ParseSize(value);
+        } else if (key == "keepage") {
+            sink_config.retention_age_s = ParseDuration(value);
+        } else if (key == "index" && sink_config.is_logging_to_file) {
+            sink_config.is_indexed = true;
         }
     }
+    if (sink_config.log_level == INVALID)
+        throw errors::InvalidLogLevel();
+}
+
+size_t Logger::ParseSize(const string& value) {
+    size_t size = stoi(value);
+    size_t unit_pos = value.find_last_not_of("0123456789");
+    string unit = "";
+    if (unit_pos <= value.size())
+        unit = value.substr(unit_pos);
+
+    if (unit == "K") {
+        return size * 1024;
+    } else if (unit == "M") {
+        return size * 1024 * 1024;
+    } else if (unit == "G") {
+        return size * 1024 * 1024 * 1024;
+    }
+    return size;
+}
+
+// Seconds, or with an s/m/h/d suffix.
+int64_t Logger::ParseDuration(const string& value) {
+    int64_t duration = stoll(value);
+    switch (value.back()) {
+    case 'm':
+        return duration * 60;
+    case 'h':
+        return duration * 60 * 60;
+    case 'd':
+        return duration * 24 * 60 * 60;
+    }
+    return duration;
 }
 
 void Logger::ConfigurationSetDefault(LogConfig& temp_config) {
@@ -138,6 +1108,33 @@ void Logger::ConfigurationSetDefault(LogConfig& temp_config) {
     temp_config.is_date_logging = false;
     temp_config.is_time_logging = false;
     temp_config.path_to_log_file = "";
+    temp_config.queue_capacity = 8192;
+    temp_config.overflow_policy = BLOCK;
+    temp_config.batch_size = 256;
+    temp_config.batch_delay_ms = 0;
+    temp_config.buffer_size = 64 * 1024;
+    temp_config.flush_interval_ms = 100;
+    temp_config.flush_level = ERROR;
+    temp_config.compression_level = Z_DEFAULT_COMPRESSION;
+    temp_config.archive_queue_limit = 4;
+    temp_config.is_binary_logging = false;
+    temp_config.is_per_thread_queue = false;
+    temp_config.is_shared_backend = false;
+    temp_config.is_fatal_flush = false;
+    temp_config.stats_interval_s = 0;
+    temp_config.is_coalescing = false;
+    temp_config.coalesce_window_s = 30;
+    temp_config.is_memory_mapped = false;
+    temp_config.msync_interval_ms = 0;
+    temp_config.rotate_interval_s = 0;
+    temp_config.retention_files = 0;
+    temp_config.retention_bytes = 0;
+    temp_config.retention_age_s = 0;
+    temp_config.is_compressed = false;
+    temp_config.is_indexed = false;
+    temp_config.flight_records = 0;
+    temp_config.flight_trigger_level = ERROR;
+    temp_config.shm_name = "";
 }
 
 LogConfig& Logger::ConfigurationCheck(LogConfig& temp_config) {
@@ -145,193 +1142,461 @@ LogConfig& Logger::ConfigurationCheck(LogConfig& temp_config) {
         throw errors::InvalidLogLevel();
     if (temp_config.is_logging_to_file == true && temp_config.path_to_log_file == "")
         throw errors::InvalidLogPath();
+    if (temp_config.batch_size == 0)
+        temp_config.batch_size = 1;
+    if (temp_config.batch_size > temp_config.queue_capacity)
+        temp_config.batch_size = temp_config.queue_capacity;
     return temp_config;
 }
 
-void Logger::Log2(LogLevel level, const string& message) {
-    if (level <= current_config_.current_log_level) {
-        try {
-            ostream& output_stream = GetOutputStream();
-            output_stream << GetTimestamp() << "[" << GetLogLevelString(level) << "] " << message << endl;
-    
-            if (output_stream.fail()) {
-                throw errors::StreamWorkFailed();
-            }
+void Logger::LogBatch(vector<Message>& batch) {
+    for (Message& message : batch) {
+        Log2(message);
+    }
+    for (auto& entry : sinks_)
+        entry.sink->FlushIfDue();
 
-            if (current_config_.file_size_limit > 0 && (long unsigned int) file_stream_.tellp() >= current_config_.file_size_limit) {
-                ChangingLogFile();
-            }
+    // Only this thread writes the histogram, so plain stores are enough.
+    int64_t now = TimestampNow();
+    for (Message& message : batch) {
+        uint64_t latency = max<int64_t>(now - message.timestamp, 1);
+        size_t bucket = min<size_t>(bit_width(latency) - 1, LoggerStats::kLatencyBuckets - 1);
+        write_latency_[bucket].store(write_latency_[bucket].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+}
+
+// Milliseconds until the first sink must write its buffer, 0 when nothing waits.
+unsigned int Logger::FlushTimeout() {
+    unsigned int timeout_ms = 0;
+    for (auto& entry : sinks_) {
+        unsigned int sink_timeout_ms = entry.sink->FlushTimeout();
+        if (sink_timeout_ms > 0 && (timeout_ms == 0 || sink_timeout_ms < timeout_ms))
+            timeout_ms = sink_timeout_ms;
+    }
+    return timeout_ms;
+}
+
+// Like FlushTimeout, but also wakes up for the next periodic stats record.
+unsigned int Logger::WaitTimeout() {
+    unsigned int timeout_ms = FlushTimeout();
+    auto add_deadline = [&timeout_ms](int64_t until_ms) {
+        unsigned int deadline_ms = static_cast<unsigned int>(clamp<int64_t>(until_ms, 1, UINT_MAX));
+        timeout_ms = timeout_ms == 0 ? deadline_ms : min(timeout_ms, deadline_ms);
+    };
+    if (Config().stats_interval_s > 0)
+        add_deadline(chrono::duration_cast<chrono::milliseconds>(next_stats_time_ - chrono::steady_clock::now()).count());
+    int64_t next_repeat_report_time = next_repeat_report_time_.load(memory_order_relaxed);
+    if (next_repeat_report_time != INT64_MAX)
+        add_deadline((next_repeat_report_time - TimestampNow()) / 1000000 + 1);
+    int64_t next_rate_report_time = next_rate_report_time_.load(memory_order_relaxed);
+    if (next_rate_report_time != INT64_MAX)
+        add_deadline((next_rate_report_time - TimestampNow()) / 1000000 + 1);
+    return timeout_ms;
+}
+
+size_t Logger::QueueDepth() {
+    if (!Config().is_per_thread_queue)
+        return messages_->Size();
+    size_t depth = 0;
+    lock_guard<mutex> lock(thread_queues_mutex_);
+    for (auto& queue : thread_queues_)
+        depth += queue->messages.Size();
+    return depth;
+}
+
+LoggerStats Logger::GetStats() {
+    LoggerStats stats;
+    for (auto& stripe : counter_stripes_) {
+        for (size_t level = 0; level < LoggerStats::kLevels; level++) {
+            stats.accepted[level] += stripe.accepted[level].load(memory_order_relaxed);
+            stats.filtered[level] += stripe.filtered[level].load(memory_order_relaxed);
+            stats.dropped[level] += stripe.dropped[level].load(memory_order_relaxed);
+            stats.suppressed[level] += stripe.suppressed[level].load(memory_order_relaxed);
+        }
+    }
+    stats.queue_depth = QueueDepth();
+    stats.max_queue_depth = max_queue_depth_.load(memory_order_relaxed);
+    for (size_t i = 0; i < LoggerStats::kLatencyBuckets; i++)
+        stats.write_latency[i] = write_latency_[i].load(memory_order_relaxed);
+    lock_guard<mutex> lock(sinks_mutex_);
+    stats.bytes_written = retired_sink_stats_.bytes_written;
+    stats.flushes = retired_sink_stats_.flushes;
+    stats.rotations = retired_sink_stats_.rotations;
+    for (auto& entry : sinks_) {
+        Sink::Stats sink_stats = entry.sink->GetStats();
+        stats.bytes_written += sink_stats.bytes_written;
+        stats.flushes += sink_stats.flushes;
+        stats.rotations += sink_stats.rotations;
+    }
+    if (archiver_) {
+        Archiver::Stats archiver_stats = archiver_->GetStats();
+        stats.archived_files = archiver_stats.archived_files;
+        stats.archive_seconds = archiver_stats.seconds;
+        stats.archive_input_bytes = archiver_stats.input_bytes;
+        stats.archive_output_bytes = archiver_stats.output_bytes;
+        stats.archive_skipped_files = archiver_stats.skipped_files;
+    }
+    return stats;
+}
+
+// Logger thread only: writes the stats record straight to the sinks, it
+// does not go through the queue it describes.
+void Logger::LogStatsIfDue() {
+    if (Config().stats_interval_s <= 0)
+        return;
+    auto now = chrono::steady_clock::now();
+    if (now < next_stats_time_)
+        return;
+    next_stats_time_ = now + chrono::seconds(Config().stats_interval_s);
+
+    LoggerStats stats = GetStats();
+    ostringstream text;
+    text << "Logger stats: accepted=" << stats.Total(stats.accepted)
+         << " filtered=" << stats.Total(stats.filtered)
+         << " dropped=" << stats.Total(stats.dropped)
+         << " suppressed=" << stats.Total(stats.suppressed)
+         << " queue=" << stats.queue_depth
+         << " max_queue=" << stats.max_queue_depth
+         << " latency_p50_ns=" << stats.LatencyPercentile(0.5)
+         << " latency_p99_ns=" << stats.LatencyPercentile(0.99)
+         << " bytes=" << stats.bytes_written
+         << " flushes=" << stats.flushes
+         << " rotations=" << stats.rotations
+         << " archived=" << stats.archived_files
+         << " archive_skipped=" << stats.archive_skipped_files;
+    if (stats.archive_input_bytes > 0)
+        text << " archive_ratio=" << double(stats.archive_output_bytes) / stats.archive_input_bytes;
+    Message message;
+    message.level = NOTICE;
+    message.timestamp = TimestampNow();
+    message.SetText(text.str());
+    Log2(message);
+}
+
+uint64_t LoggerStats::Total(const uint64_t (&counts)[kLevels]) const {
+    uint64_t total = 0;
+    for (uint64_t count : counts)
+        total += count;
+    return total;
+}
+
+uint64_t LoggerStats::LatencyPercentile(double fraction) const {
+    uint64_t total = 0;
+    for (uint64_t count : write_latency)
+        total += count;
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kLatencyBuckets; i++) {
+        seen += write_latency[i];
+        if (seen > rank)
+            return uint64_t(1) << (i + 1);
+    }
+    return uint64_t(1) << kLatencyBuckets;
+}
+
+// Formats the record once into record_buffer_ and hands the same bytes to
+// every sink that accepts its level.
+void Logger::Log2(const Message& message) {
+    LogLevel level = message.level;
+    if (level > log_level_threshold_.load(memory_order_relaxed) && !message.is_flight_record && message.category == 0)
+        return;
+    const CategoryState* category = message.category ? categories_[message.category - 1].get() : nullptr;
+    record_buffer_.clear();
+    try {
+        if (Config().is_binary_logging) {
+            binary::AppendRecord(record_buffer_, message.level, message.category, message.timestamp, message.format_id,
+                                 message.PayloadData(), static_cast<uint32_t>(message.PayloadSize()));
+        } else {
+            AppendRecordPrefix(record_buffer_, timestamp_formatter_, level, message.timestamp,
+                               category ? string_view(category->name) : string_view());
+            if (message.format_id == 0)
+                record_buffer_.append(message.PayloadData(), message.PayloadSize());
+            else
+                FormatArgs(FormatRegistry::Get(message.format_id), message.PayloadData(), message.PayloadSize(), record_buffer_);
+            record_buffer_ += '\n';
+        }
+    } catch (exception& e) {
+        cerr << "Logger error occured: " << e.what() << endl;
+        return;
+    }
+
+    // Flight records go wherever their trigger goes.
+    LogLevel sink_level = message.is_flight_record ? Config().flight_trigger_level : level;
+    bool is_category_configured = category && category->is_configured.load(memory_order_relaxed);
+    for (auto& entry : sinks_) {
+        if (!(is_category_configured && entry.is_primary) && !entry.sink->IsAccepted(sink_level))
+            continue;
+        try {
+            entry.sink->StartRecord(message.timestamp);
+            if (Config().is_binary_logging)
+                WriteBinaryRecord(entry, level, message.format_id, message.category);
+            else
+                entry.sink->Write(level, record_buffer_.data(), record_buffer_.size());
         } catch (exception& e) {
-            cout << "Logger error occured: " << e.what() << endl;
-            return;
+            cerr << "Logger error occured: " << e.what() << endl;
         }
     }
 }
 
-ostream& Logger::GetOutputStream() {
-    if (file_stream_.is_open()) {
-        return file_stream_;
-    } else if (current_config_.is_logging_to_file) {
-        string current_log_file_name;
-        if (!current_config_.is_file_needed_to_archivate)
-            current_log_file_name = GetFilename();
-        else
-            current_log_file_name = current_config_.path_to_log_file;
-        file_stream_.open(current_log_file_name, ios::out | ios::app);
-        if (!file_stream_.is_open()) {
-            throw errors::StreamNotOpened();
+// Each sink file is a segment of its own: the header and the format and
+// category definitions are repeated in every file the record lands in.
+void Logger::WriteBinaryRecord(SinkEntry& entry, LogLevel level, uint32_t format_id, uint16_t category) {
+    Sink& sink = *entry.sink;
+    bool is_segment_new = entry.binary_segment != sink.GetSegment();
+    if (is_segment_new) {
+        entry.defined_formats.clear();
+        entry.defined_categories.clear();
+        entry.binary_segment = sink.GetSegment();
+    }
+    bool is_format_new = false;
+    if (format_id != 0) {
+        if (entry.defined_formats.size() <= format_id)
+            entry.defined_formats.resize(format_id + 1);
+        is_format_new = !entry.defined_formats[format_id];
+        entry.defined_formats[format_id] = true;
+    }
+    bool is_category_new = false;
+    if (category != 0) {
+        if (entry.defined_categories.size() <= category)
+            entry.defined_categories.resize(category + 1);
+        is_category_new = !entry.defined_categories[category];
+        entry.defined_categories[category] = true;
+    }
+    if (!is_segment_new && !is_format_new && !is_category_new) {
+        sink.Write(level, record_buffer_.data(), record_buffer_.size());
+        return;
+    }
+
+    binary_preamble_.clear();
+    if (is_segment_new)
+        binary::AppendSegmentHeader(binary_preamble_, Config().is_date_logging, Config().is_time_logging);
+    if (is_format_new)
+        binary::AppendFormatDefinition(binary_preamble_, format_id, FormatRegistry::Get(format_id));
+    if (is_category_new)
+        binary::AppendCategoryDefinition(binary_preamble_, category, categories_[category - 1]->name);
+    binary_preamble_ += record_buffer_;
+    sink.Write(level, binary_preamble_.data(), binary_preamble_.size());
+}
+
+void Logger::FlushSinks() {
+    for (auto& entry : sinks_)
+        entry.sink->Flush();
+}
+
+// Best effort: the process is going down, so the handlers wait a bounded
+// time for the logger threads instead of touching the sinks themselves.
+void Logger::InstallFatalHandlers() {
+    static once_flag once;
+    call_once(once, [] {
+        struct sigaction action = {};
+        action.sa_handler = FatalSignalHandler;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < size(kFatalSignals); i++)
+            sigaction(kFatalSignals[i], &action, &previous_signal_actions[i]);
+        previous_terminate_handler = set_terminate(FatalTerminateHandler);
+    });
+}
+
+// Restores the previous handler and raises again once this one returns.
+void Logger::FatalSignalHandler(int signal) {
+    FlushAllForFatal();
+    for (size_t i = 0; i < size(kFatalSignals); i++) {
+        if (kFatalSignals[i] == signal)
+            sigaction(signal, &previous_signal_actions[i], nullptr);
+    }
+    raise(signal);
+}
+
+void Logger::FatalTerminateHandler() {
+    FlushAllForFatal();
+    if (previous_terminate_handler)
+        previous_terminate_handler();
+    abort();
+}
+
+// All flushes are requested first and share one deadline. A logger whose
+// consumer is the crashing thread can not flush and is skipped.
+void Logger::FlushAllForFatal() {
+    Logger* loggers[kMaxFatalLoggers] = {};
+    uint64_t flush_requested[kMaxFatalLoggers] = {};
+    for (size_t i = 0; i < kMaxFatalLoggers; i++) {
+        Logger* logger = fatal_loggers_[i].load(memory_order_acquire);
+        if (logger && !logger->IsConsumerThread()) {
+            loggers[i] = logger;
+            flush_requested[i] = logger->RequestFatalFlush();
         }
-        file_number_++;
-        return file_stream_;
-    } else {
-        return cout;
+    }
+    auto deadline = chrono::steady_clock::now() + kFatalFlushTimeout;
+    for (size_t i = 0; i < kMaxFatalLoggers; i++) {
+        if (!loggers[i])
+            continue;
+        while (loggers[i]->flush_completed_.load(memory_order_acquire) < flush_requested[i] &&
+               chrono::steady_clock::now() < deadline)
+            this_thread::sleep_for(chrono::milliseconds(1));
     }
 }
 
-string Logger::GetFilename() {
-    size_t unit_pos = current_config_.path_to_log_file.find_last_of(".");
-    string unit = current_config_.path_to_log_file.substr(0, unit_pos);
-    unit = unit + "_" + to_string(file_number_) + 
-        current_config_.path_to_log_file.substr(unit_pos, sizeof(current_config_.path_to_log_file) - unit_pos - 1);
-    return unit;
+uint64_t Logger::RequestFatalFlush() {
+    uint64_t flush_requested = flush_requested_.fetch_add(1, memory_order_acq_rel) + 1;
+    if (backend_)
+        backend_->Wake();
+    else
+        condition_variable_.notify_one();
+    return flush_requested;
 }
 
-const char* Logger::GetZipName(string& base_filename) {
-    size_t unit_pos = current_config_.path_to_log_file.find_last_of(".");
-    base_filename = current_config_.path_to_log_file.substr(0, unit_pos);
-    base_filename = base_filename + "_" + to_string(file_number_) + ".gz";
-    return base_filename.c_str();
+bool Logger::IsConsumerThread() const {
+    if (backend_)
+        return Backend::IsBackendThread();
+    return this_thread::get_id() == logger_thread_.get_id();
 }
 
-unsigned long Logger::file_size(const char *filename)
-{
-    FILE *pFile = fopen(filename, "rb");
-    fseek (pFile, 0, SEEK_END);
-    unsigned long size = ftell(pFile);
-    fclose (pFile);
-    return size;
+SinkConfig Logger::GetPrimarySinkConfig(const LogConfig& config) {
+    SinkConfig sink_config;
+    sink_config.is_logging_to_file = config.is_logging_to_file;
+    sink_config.path_to_log_file = config.path_to_log_file;
+    sink_config.log_level = config.current_log_level;
+    sink_config.buffer_size = config.buffer_size;
+    sink_config.flush_interval_ms = config.flush_interval_ms;
+    sink_config.flush_level = config.flush_level;
+    sink_config.file_size_limit = config.file_size_limit;
+    sink_config.is_file_needed_to_archivate = config.is_file_needed_to_archivate;
+    sink_config.is_memory_mapped = config.is_memory_mapped;
+    sink_config.msync_interval_ms = config.msync_interval_ms;
+    sink_config.rotate_interval_s = config.rotate_interval_s;
+    sink_config.retention_files = config.retention_files;
+    sink_config.retention_bytes = config.retention_bytes;
+    sink_config.retention_age_s = config.retention_age_s;
+    sink_config.is_compressed = config.is_compressed;
+    sink_config.compression_level = config.compression_level;
+    sink_config.is_indexed = config.is_indexed;
+    return sink_config;
+}
+
+// File sinks leave everything but writing to the Archiver thread.
+bool Logger::IsArchiverNeeded(const LogConfig& config) {
+    auto is_rotating = [](const SinkConfig& sink_config) {
+        return sink_config.is_logging_to_file && (sink_config.is_file_needed_to_archivate ||
+            sink_config.file_size_limit > 0 || sink_config.rotate_interval_s > 0);
+    };
+    bool is_archiver_needed = is_rotating(GetPrimarySinkConfig(config));
+    for (auto& sink_config : config.extra_sinks)
+        is_archiver_needed = is_archiver_needed || is_rotating(sink_config);
+    return is_archiver_needed;
+}
+
+// With "shm" the collector owns the output; only custom sinks are kept,
+// and they receive nothing.
+void Logger::CreateSinks(const LogConfig& config, vector<SinkEntry>& sinks) {
+    if (!config.shm_name.empty())
+        return;
+    sinks.push_back({CreateSink(GetPrimarySinkConfig(config)), false, true});
+    for (auto& sink_config : config.extra_sinks)
+        sinks.push_back({CreateSink(sink_config)});
+}
+
+// Producers filter with the most verbose sink, each sink filters again.
+// Without sinks of its own a "shm" logger filters with lev.
+void Logger::UpdateThreshold() {
+    LogLevel threshold = Config().shm_name.empty() ? INVALID : Config().current_log_level;
+    for (auto& entry : sinks_)
+        threshold = max(threshold, entry.sink->GetLevel());
+    log_level_threshold_.store(threshold, memory_order_release);
+    record_level_threshold_.store(Config().flight_records > 0 ? DEBUG : threshold, memory_order_release);
+
+    lock_guard<mutex> lock(categories_mutex_);
+    for (size_t i = 0; i < category_count_; i++)
+        ResolveCategory(*categories_[i]);
+}
+
+LogCategory Logger::Category(const string& name) {
+    lock_guard<mutex> lock(categories_mutex_);
+    for (size_t i = 0; i < category_count_; i++) {
+        if (categories_[i]->name == name)
+            return LogCategory(*this, *categories_[i], static_cast<uint16_t>(i + 1));
+    }
+    if (category_count_ == kMaxCategories)
+        throw errors::TooManyCategories();
+    auto state = make_unique<CategoryState>();
+    state->name = name;
+    ResolveCategory(*state);
+    categories_[category_count_] = move(state);
+    category_count_++;
+    return LogCategory(*this, *categories_[category_count_ - 1], static_cast<uint16_t>(category_count_));
+}
+
+// The longest prefix that is the name or ends where one of its parts does
+// wins; of equal prefixes the last one given. Without one, lev applies.
+void Logger::ResolveCategory(CategoryState& state) {
+    const LogConfig& config = Config();
+    const string& name = state.name;
+    size_t matched_length = 0;
+    bool is_configured = false;
+    LogLevel level = config.current_log_level;
+    for (auto& [prefix, prefix_level] : config.category_levels) {
+        bool is_matching = name.compare(0, prefix.size(), prefix) == 0 &&
+            (name.size() == prefix.size() || name[prefix.size()] == '.');
+        if (is_matching && (!is_configured || prefix.size() >= matched_length)) {
+            matched_length = prefix.size();
+            level = prefix_level;
+            is_configured = true;
+        }
+    }
+    state.level.store(level, memory_order_relaxed);
+    state.record_level.store(config.flight_records > 0 ? DEBUG : level, memory_order_relaxed);
+    state.is_configured.store(is_configured, memory_order_relaxed);
 }
 
-int Logger::compress_one_file(const char *infilename, const char *outfilename)
-{
-    FILE *infile = fopen(infilename, "rb");
-    gzFile outfile = gzopen(outfilename, "wb");
-    if (!infile || !outfile) return -1;
-    char inbuffer[128];
-    int num_read = 0;
-    unsigned long total_read = 0;
-    while ((num_read = fread(inbuffer, 1, sizeof(inbuffer), infile)) > 0) {
-        total_read += num_read;
-        gzwrite(outfile, inbuffer, num_read);
-    }
-    fclose(infile);
-    gzclose(outfile);
-
-    printf("Read %ld bytes, Wrote %ld bytes, Compression factor %4.2f%%n\n", 
-        total_read, file_size(outfilename),
-        (1.0-file_size(outfilename)*1.0/total_read)*100.0);
-    return 0;
-}
-
-void Logger::ChangingLogFile() {
-    file_stream_.close();
-    
-    if (current_config_.is_file_needed_to_archivate) {
-        const char* filename = current_config_.path_to_log_file.c_str();
-        string base_filename;
-        const char* zipname = GetZipName(base_filename);
-        if (compress_one_file(filename, zipname))
-            throw errors::InvalidLogOrZipFilename();
-        cout << "Archivated file " << file_number_ << endl;
-        if (remove(filename)) {
-            cout << "Warning: Check log file" << endl;
-        }
-    }
-}
-
-string Logger::GetTimestamp() {
-    auto now = chrono::system_clock::time_point(chrono::system_clock::now());
-    auto time_t = chrono::system_clock::to_time_t(now);
-    auto duration = now.time_since_epoch();
-    ostringstream oss;
-    if (current_config_.is_date_logging) {
-        oss << put_time(localtime(&time_t), "%Y-%m-%d ");
-    }
-    if (current_config_.is_time_logging) {
-        typedef chrono::duration< int, ratio_multiply< chrono::hours::period, ratio< 21 > >::type > Days;
-        Days days = chrono::duration_cast< Days >( duration );
-        duration -= days;
-
-        auto hours = chrono::duration_cast< chrono::hours >( duration );
-        duration -= hours;
-
-        auto minutes = chrono::duration_cast< chrono::minutes >( duration );
-        duration -= minutes;
-
-        auto seconds = chrono::duration_cast< chrono::seconds >( duration );
-        duration -= seconds;
-
-        auto milliseconds = chrono::duration_cast< chrono::milliseconds >( duration );
-        duration -= milliseconds;
-
-        auto microseconds = chrono::duration_cast< chrono::microseconds >( duration );
-        duration -= microseconds;
-
-        auto nanoseconds = chrono::duration_cast< chrono::nanoseconds >( duration );
-        oss << hours.count() << ":"
-            << minutes.count() << ":"
-            << seconds.count() << ":"
-            << milliseconds.count() << ":"
-            << microseconds.count() << ":"
-            << nanoseconds.count() << " ";
+unique_ptr<Sink> Logger::CreateSink(const SinkConfig& sink_config) {
+    if (sink_config.is_logging_to_file && sink_config.is_compressed)
+        return make_unique<GzipFileSink>(sink_config, archiver_.get());
+    if (sink_config.is_logging_to_file && sink_config.is_memory_mapped)
+        return make_unique<MmapFileSink>(sink_config, archiver_.get());
+    if (sink_config.is_logging_to_file)
+        return make_unique<FileSink>(sink_config, archiver_.get());
+    return make_unique<StreamSink>(sink_config, cout);
+}
+
+RecordStream::RecordStream(Logger& logger, LogLevel level, uint16_t category)
+    : logger_(logger), level_(level), category_(category) {
+    if (!logger.IsRecorded(level, category)) {
+        logger.CountFiltered(level);
+        return;
+    }
+    if (stream_buffer.is_used) {
+        buffer_ = &own_buffer_;
     } else {
-        return "";
+        stream_buffer.is_used = true;
+        buffer_ = &stream_buffer.text;
+        buffer_->clear();
     }
-    return oss.str();
 }
 
-string Logger::GetLogLevelString(LogLevel& level) {
+RecordStream::~RecordStream() {
+    if (!buffer_)
+        return;
+    logger_.LogText(level_, string_view(*buffer_), category_);
+    if (buffer_ == &stream_buffer.text)
+        stream_buffer.is_used = false;
+}
+
+const char* logger::LogLevelName(LogLevel level) {
     static const char* levelStrings[] = {"INVALID", "EMERGENCY", "ALERT", "CRITICAL", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG"};
     return levelStrings[level];
 }
 
-void Logger::Emergency(const string& message) {
-    Message mes = {EMERGENCY, message};
-    Log(mes);
-    return;
-}
-void Logger::Alert(const string& message) {
-    Message mes = {ALERT, message};
-    Log(mes);
-    return;
-}
-void Logger::Critical(const string& message) {
-    Message mes = {CRITICAL, message};
-    Log(mes);
-    return;
-}
-void Logger::Error(const string& message) {
-    Message mes = {ERROR, message};
-    Log(mes);
-    return;
-}
-void Logger::Warning(const string& message) {
-    Message mes = {WARNING, message};
-    Log(mes);
-    return;
-}
-void Logger::Notice(const string& message) {
-    Message mes = {NOTICE, message};
-    Log(mes);
-    return;
-}
-void Logger::Info(const string& message) {
-    Message mes = {INFO, message};
-    Log(mes);
-    return;
-}
-void Logger::Debug(const string& message) {
-    Message mes = {DEBUG, message};
-    Log(mes);
-    return;
-}
\ No newline at end of file
+void logger::AppendRecordPrefix(string& out, TimestampFormatter& timestamp_formatter, LogLevel level, int64_t timestamp,
+                                string_view category) {
+    char buffer[TimestampFormatter::kMaxLength];
+    size_t length = timestamp_formatter.Format(timestamp, buffer);
+    out.append(buffer, length);
+    out += "[";
+    out += LogLevelName(level);
+    if (!category.empty()) {
+        out += ':';
+        out += category;
+    }
+    out += "] ";
+}
@@ -5,15 +5,30 @@
 #include <iostream>
 #include <stdio.h>
 #include <zlib.h>
+#include <charconv>
 #include <chrono>
+#include <concepts>
+#include <cstring>
 #include <exception>
 #include <iomanip>
 #include <cstddef>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <vector>
+#include <memory>
+#include "archiver.hpp"
+#include "backend.hpp"
+#include "format.hpp"
+#include "rate_limiter.hpp"
+#include "ring_buffer.hpp"
+#include "segment_index.hpp"
+#include "shared_ring.hpp"
+#include "timestamp.hpp"
 
 namespace errors {
     class LoggerException : public std::exception {
@@ -71,6 +86,20 @@ namespace errors {
             return "File was no deleted, recording to stream must be suspended";
         }
     };
+
+    class SharedMemoryNotOpened : public LoggerException {
+    public:
+        virtual const char* what() const throw() {
+            return "Shared memory queue could not be created";
+        }
+    };
+
+    class TooManyCategories : public LoggerException {
+    public:
+        virtual const char* what() const throw() {
+            return "Too many log categories were created";
+        }
+    };
 }
 
 namespace logger {
@@ -81,10 +110,109 @@ namespace logger {
         INVALID = 0, EMERGENCY, ALERT, CRITICAL, ERROR, WARNING, NOTICE, INFO, DEBUG
     };
 
+    // The text of a record, or the encoded arguments of a formatted one, is
+    // kept inline; only payloads larger than kInlineSize spill into message.
+    // With the ring's sequence number a queue cell is exactly four cache
+    // lines, and copies move only the bytes in use.
     struct Message
     {
-        LogLevel level;
+        static constexpr size_t kInlineSize = 192;
+
+        LogLevel level = INVALID;
+        // Held back by the flight recorder and written with a trigger record.
+        bool is_flight_record = false;
+        // Logger::Category() the record was logged through, index + 1; 0 for none.
+        uint16_t category = 0;
         string message;
+        int64_t timestamp = 0;
+        uint32_t format_id = 0;
+        uint32_t inline_size = 0;
+        char inline_data[kInlineSize];
+
+        Message() = default;
+
+        Message(const Message& other) : message(other.message) {
+            CopyFields(other);
+        }
+
+        Message(Message&& other) noexcept : message(move(other.message)) {
+            CopyFields(other);
+        }
+
+        Message& operator=(const Message& other) {
+            message = other.message;
+            CopyFields(other);
+            return *this;
+        }
+
+        Message& operator=(Message&& other) noexcept {
+            message = move(other.message);
+            CopyFields(other);
+            return *this;
+        }
+
+        void SetText(string_view text) {
+            format_id = 0;
+            if (text.size() <= kInlineSize) {
+                memcpy(inline_data, text.data(), text.size());
+                inline_size = static_cast<uint32_t>(text.size());
+                message.clear();
+            } else {
+                message.assign(text);
+                inline_size = 0;
+            }
+        }
+
+        // Takes over the caller's buffer instead of copying a spilled text.
+        void SetText(string&& text) {
+            if (text.size() <= kInlineSize) {
+                SetText(string_view(text));
+                return;
+            }
+            format_id = 0;
+            message = move(text);
+            inline_size = 0;
+        }
+
+        const char* PayloadData() const {
+            return inline_size ? inline_data : message.data();
+        }
+
+        size_t PayloadSize() const {
+            return inline_size ? inline_size : message.size();
+        }
+
+    private:
+        void CopyFields(const Message& other) {
+            level = other.level;
+            is_flight_record = other.is_flight_record;
+            category = other.category;
+            timestamp = other.timestamp;
+            format_id = other.format_id;
+            inline_size = other.inline_size;
+            memcpy(inline_data, other.inline_data, inline_size);
+        }
+    };
+
+    struct SinkConfig
+    {
+        bool is_logging_to_file;
+        string path_to_log_file;
+        LogLevel log_level;
+        size_t buffer_size;
+        unsigned int flush_interval_ms;
+        LogLevel flush_level;
+        size_t file_size_limit;
+        bool is_file_needed_to_archivate;
+        bool is_memory_mapped;
+        unsigned int msync_interval_ms;
+        int64_t rotate_interval_s;
+        size_t retention_files;
+        size_t retention_bytes;
+        int64_t retention_age_s;
+        bool is_compressed;
+        int compression_level;
+        bool is_indexed;
     };
 
     struct LogConfig
@@ -96,51 +224,1034 @@ namespace logger {
         bool is_time_logging;
         size_t file_size_limit;
         bool is_file_needed_to_archivate;
+        size_t queue_capacity;
+        OverflowPolicy overflow_policy;
+        size_t batch_size;
+        unsigned int batch_delay_ms;
+        size_t buffer_size;
+        unsigned int flush_interval_ms;
+        LogLevel flush_level;
+        int compression_level;
+        size_t archive_queue_limit;
+        bool is_binary_logging;
+        bool is_per_thread_queue;
+        bool is_shared_backend;
+        bool is_fatal_flush;
+        int64_t stats_interval_s;
+        bool is_coalescing;
+        int64_t coalesce_window_s;
+        bool is_memory_mapped;
+        unsigned int msync_interval_ms;
+        int64_t rotate_interval_s;
+        size_t retention_files;
+        size_t retention_bytes;
+        int64_t retention_age_s;
+        bool is_compressed;
+        bool is_indexed;
+        size_t flight_records;
+        LogLevel flight_trigger_level;
+        string shm_name;
+        // "cat=<prefix>:<level>" in the order given.
+        vector<pair<string, LogLevel>> category_levels;
+        vector<SinkConfig> extra_sinks;
     };
 
+    // Destination of formatted records with its own level filter and write
+    // buffer. Records arrive already formatted; a sink only buffers them and
+    // decides when to hand them to WriteOut().
+    class Sink
+    {
+    public:
+        Sink(const SinkConfig& config);
+        virtual ~Sink() = default;
+
+        bool IsAccepted(LogLevel level) const {
+            return level <= level_;
+        }
+        LogLevel GetLevel() const {
+            return level_;
+        }
+        // Changes every time the sink starts a new output file.
+        uint64_t GetSegment() const {
+            return segment_;
+        }
+
+        // Called before each accepted record; a sink that starts a new file
+        // here makes the record the first one of that file.
+        virtual void StartRecord(int64_t /*timestamp*/) {}
+        virtual void Write(LogLevel level, const char* data, size_t size);
+        virtual void FlushIfDue();
+        virtual void Flush();
+        // Milliseconds until buffered records must be written, 0 when nothing waits.
+        virtual unsigned int FlushTimeout() const;
+
+        struct Stats
+        {
+            uint64_t bytes_written;
+            uint64_t flushes;
+            uint64_t rotations;
+        };
+
+        Stats GetStats() const {
+            return {bytes_written_.load(memory_order_relaxed), flushes_.load(memory_order_relaxed),
+                    rotations_.load(memory_order_relaxed)};
+        }
+
+    protected:
+        virtual void WriteOut(const char* data, size_t size) = 0;
+
+        bool IsUrgent(LogLevel level) const {
+            return level <= flush_level_;
+        }
+
+        // Updated by the writing thread only, read by Logger::GetStats().
+        static void Increment(atomic<uint64_t>& counter, uint64_t value = 1) {
+            counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+        }
+
+        string buffer_;
+        uint64_t segment_ = 0;
+        atomic<uint64_t> bytes_written_ = 0;
+        atomic<uint64_t> flushes_ = 0;
+        atomic<uint64_t> rotations_ = 0;
+
+    private:
+        LogLevel level_;
+        size_t buffer_size_;
+        unsigned int flush_interval_ms_;
+        LogLevel flush_level_;
+        bool is_flush_needed_ = false;
+        chrono::steady_clock::time_point last_flush_time_;
+    };
+
+    class StreamSink : public Sink
+    {
+    public:
+        StreamSink(const SinkConfig& config, ostream& stream);
+        ~StreamSink() override;
+
+    protected:
+        void WriteOut(const char* data, size_t size) override;
+
+    private:
+        ostream& stream_;
+    };
+
+    // Numbered files shared by the file sinks: path_N.ext, or with archiving
+    // path.ext renamed to path_N.ext and gzipped to path_N.gz. Rotation only
+    // swaps in a file opened ahead of time; closing, renaming, compressing,
+    // retention and opening the following file run on the Archiver thread.
+    class RotatingSink : public Sink
+    {
+    public:
+        RotatingSink(const SinkConfig& config, Archiver* archiver);
+
+        void StartRecord(int64_t timestamp) override;
+
+    protected:
+        // Result of opening a file on the Archiver thread.
+        template <typename T>
+        struct Prepared
+        {
+            mutex mutex_;
+            condition_variable condition_variable_;
+            bool is_ready = false;
+            T value;
+        };
+
+        template <typename T, typename Open>
+        shared_ptr<Prepared<T>> PrepareFile(Open open) {
+            auto prepared = make_shared<Prepared<T>>();
+            next_filename_ = NextFilename();
+            archiver_->Post([prepared, filename = next_filename_, open] {
+                T value = open(filename);
+                lock_guard<mutex> lock(prepared->mutex_);
+                prepared->value = move(value);
+                prepared->is_ready = true;
+                prepared->condition_variable_.notify_all();
+            });
+            return prepared;
+        }
+
+        template <typename T>
+        static T TakePrepared(Prepared<T>& prepared) {
+            unique_lock<mutex> lock(prepared.mutex_);
+            prepared.condition_variable_.wait(lock, [&prepared] { return prepared.is_ready; });
+            return move(prepared.value);
+        }
+
+        bool IsRotating() const {
+            return archiver_ && (config_.file_size_limit > 0 || config_.rotate_interval_s > 0);
+        }
+        // Name of the file to open now; counts the file as opened.
+        string OpenFilename();
+        // Name the next file is prepared under.
+        string NextFilename();
+        string GetFilename();
+        string GetFilename(unsigned int file_number);
+        const char* GetZipName(string& base_filename);
+        // Called after the current file was taken out of use, before the next
+        // one is counted as opened; close_file runs on the Archiver thread.
+        void FinishFile(function<void()> close_file, bool is_next_prepared);
+
+        virtual bool IsFileEmpty() const = 0;
+        virtual void Rotate() = 0;
+
+        // "index": called by Write before the record is buffered.
+        void IndexRecord(LogLevel level, size_t size) {
+            if (config_.is_indexed) {
+                index_.AddRecord(level, record_timestamp_, index_offset_);
+                index_offset_ += size;
+            }
+        }
+        // A file holding existing_size bytes was taken into use.
+        void StartIndex(const string& filename, uint64_t existing_size);
+        void ResetIndex();
+        // Destructors: the sidecar of the file still in use.
+        void WriteCurrentIndex();
+
+        SinkConfig config_;
+        Archiver* archiver_;
+        unsigned int file_number_ = 0;
+        string next_filename_;
+        int64_t next_rotation_time_ = 0;
+        int64_t record_timestamp_ = 0;
+        SegmentIndex index_;
+        uint64_t index_offset_ = 0;
+        bool is_index_compressed_ = false;
+    };
+
+    class FileSink : public RotatingSink
+    {
+    public:
+        FileSink(const SinkConfig& config, Archiver* archiver);
+        ~FileSink() override;
+
+        void Write(LogLevel level, const char* data, size_t size) override;
+
+    protected:
+        void WriteOut(const char* data, size_t size) override;
+        bool IsFileEmpty() const override;
+        void Rotate() override;
+
+    private:
+        struct OpenedStream
+        {
+            ofstream stream;
+            size_t size = 0;
+        };
+
+        static OpenedStream OpenStream(const string& filename);
+        ostream& GetOutputStream();
+
+        ofstream file_stream_;
+        size_t file_bytes_written_ = 0;
+        shared_ptr<Prepared<OpenedStream>> next_stream_;
+    };
+
+    // Copies records straight into a shared mapping of a segment preallocated
+    // to the trunc= size; without a limit the file grows in kGrowStep steps.
+    // A closed segment is truncated to its used length. Until then the file
+    // ends in zero bytes; after a crash they stay, and reopening the file
+    // finds the end of the records and continues there.
+    class MmapFileSink : public RotatingSink
+    {
+    public:
+        MmapFileSink(const SinkConfig& config, Archiver* archiver);
+        ~MmapFileSink() override;
+
+        void Write(LogLevel level, const char* data, size_t size) override;
+        void FlushIfDue() override;
+        void Flush() override;
+        unsigned int FlushTimeout() const override;
+
+    protected:
+        void WriteOut(const char* data, size_t size) override;
+        bool IsFileEmpty() const override;
+        void Rotate() override;
+
+    private:
+        static constexpr size_t kGrowStep = 16 * 1024 * 1024;
+
+        struct MappedFile
+        {
+            int fd = -1;
+            char* data = nullptr;
+            size_t capacity = 0;
+            size_t offset = 0;
+        };
+
+        static MappedFile OpenMapped(const string& filename, size_t file_size_limit);
+        static bool MapFile(MappedFile& file, size_t capacity);
+        static void CloseMapped(MappedFile& file, bool is_sync_needed);
+        void Sync();
+
+        MappedFile file_;
+        size_t synced_offset_ = 0;
+        bool is_sync_needed_ = false;
+        chrono::steady_clock::time_point last_sync_time_;
+        shared_ptr<Prepared<MappedFile>> next_file_;
+    };
+
+    // Deflates records straight into path_N.gz. Every write of the buffer
+    // ends with a Z_SYNC_FLUSH, so a crash loses at most the records not
+    // written yet and the file can be read with zcat while it grows. trunc=
+    // applies to the compressed size.
+    class GzipFileSink : public RotatingSink
+    {
+    public:
+        GzipFileSink(const SinkConfig& config, Archiver* archiver);
+        ~GzipFileSink() override;
+
+        void Write(LogLevel level, const char* data, size_t size) override;
+
+    protected:
+        void WriteOut(const char* data, size_t size) override;
+        bool IsFileEmpty() const override;
+        void Rotate() override;
+
+    private:
+        static gzFile OpenGzip(const string& filename, int compression_level);
+
+        gzFile file_ = nullptr;
+        size_t file_bytes_written_ = 0;
+        uint64_t last_restart_offset_ = 0;
+        shared_ptr<Prepared<gzFile>> next_file_;
+    };
+
+    // Queue owned by one producer thread in "perthread" mode.
+    struct ThreadQueue
+    {
+        explicit ThreadQueue(size_t capacity) : messages(capacity) {}
+
+        SpscQueue<Message> messages;
+        atomic_bool is_producer_exited = false;
+        atomic_bool is_logger_closed = false;
+    };
+
+    // Last record a producer thread sent to a "coalesce" logger and how often
+    // it has been repeated since. The thread reports a run it ends itself;
+    // the consumer reports the others once the window has passed, on Flush()
+    // and when the thread or the logger goes away.
+    struct RepeatState
+    {
+        mutex state_mutex;
+        LogLevel level = INVALID;
+        uint16_t category = 0;
+        uint32_t format_id = 0;
+        string payload;
+        uint64_t repeats = 0;
+        int64_t first_repeat_time = 0;
+        atomic_bool is_producer_exited = false;
+        atomic_bool is_logger_closed = false;
+    };
+
+    // Call site whose rate limiter refused records for a logger. The
+    // consumer reports the count once no more are refused, so a storm that
+    // stops is not left unreported until the site is admitted again.
+    struct RateLimitState
+    {
+        RateLimiter* limiter = nullptr;
+        LogLevel level = INVALID;
+        uint16_t category = 0;
+        const char* file = nullptr;
+        int line = 0;
+        uint64_t last_suppressed = 0;
+    };
+
+    // Snapshot returned by Logger::GetStats(); per-level arrays are indexed
+    // by LogLevel.
+    struct LoggerStats
+    {
+        static constexpr size_t kLevels = DEBUG + 1;
+        static constexpr size_t kLatencyBuckets = 40;
+
+        uint64_t accepted[kLevels] = {};
+        // Rejected by the level check of a Logger method. LOG_* call sites
+        // check the level themselves and are not counted.
+        uint64_t filtered[kLevels] = {};
+        uint64_t dropped[kLevels] = {};
+        // Refused by a LOG_*_LIMITED rate limit or coalesced as a repeat.
+        uint64_t suppressed[kLevels] = {};
+        size_t queue_depth = 0;
+        size_t max_queue_depth = 0;
+        // Enqueue-to-write latency: bucket i counts records that took less
+        // than 2^(i+1) ns and, except for bucket 0, at least 2^i ns.
+        uint64_t write_latency[kLatencyBuckets] = {};
+        uint64_t bytes_written = 0;
+        uint64_t flushes = 0;
+        uint64_t rotations = 0;
+        uint64_t archived_files = 0;
+        double archive_seconds = 0;
+        uint64_t archive_input_bytes = 0;
+        uint64_t archive_output_bytes = 0;
+        // Rotated files the archiver could not take at once ("archmax");
+        // each is compressed later if retention keeps it.
+        uint64_t archive_skipped_files = 0;
+
+        uint64_t Total(const uint64_t (&counts)[kLevels]) const;
+        // Upper bound in ns of the bucket holding the given fraction of records.
+        uint64_t LatencyPercentile(double fraction) const;
+    };
+
+    const char* LogLevelName(LogLevel level);
+    void AppendRecordPrefix(string& out, TimestampFormatter& timestamp_formatter, LogLevel level, int64_t timestamp,
+                            string_view category = {});
+
+    class RecordStream;
+    class LogCategory;
+
     class Logger
     {
     public:
-        Logger(const string& config);
+        // Custom sinks receive the same formatted records as the configured ones.
+        Logger(const string& config, vector<unique_ptr<Sink>> sinks = {});
+        // Writes out everything still queued; producers must have stopped.
         ~Logger();
 
-        void Emergency(const string& message);
-        void Alert(const string& message);
-        void Critical(const string& message);
-        void Error(const string& message);
-        void Warning(const string& message);
-        void Notice(const string& message);
-        void Info(const string& message);
-        void Debug(const string& message);
+        // Returns once every record enqueued before the call has been
+        // written by its sinks. Must not be called from a sink.
+        void Flush();
+
+        // Applies a new configuration string, in the constructor's syntax,
+        // to the running logger and returns once it is in effect. Records
+        // logged before the call are written with the old settings. Queue
+        // size, perthread, backend, binary, fatalflush, archmax and shm can
+        // not be changed. Throws like the constructor on an invalid string.
+        void Reconfigure(const string& config);
+
+        // Texts up to Message::kInlineSize are copied into the queue slot;
+        // a longer rvalue string is moved there instead of copied.
+        void Emergency(string_view message) { LogText(EMERGENCY, message); }
+        void Alert(string_view message) { LogText(ALERT, message); }
+        void Critical(string_view message) { LogText(CRITICAL, message); }
+        void Error(string_view message) { LogText(ERROR, message); }
+        void Warning(string_view message) { LogText(WARNING, message); }
+        void Notice(string_view message) { LogText(NOTICE, message); }
+        void Info(string_view message) { LogText(INFO, message); }
+        void Debug(string_view message) { LogText(DEBUG, message); }
+
+        template <same_as<string> Text>
+        void Emergency(Text&& message) { LogText(EMERGENCY, move(message)); }
+        template <same_as<string> Text>
+        void Alert(Text&& message) { LogText(ALERT, move(message)); }
+        template <same_as<string> Text>
+        void Critical(Text&& message) { LogText(CRITICAL, move(message)); }
+        template <same_as<string> Text>
+        void Error(Text&& message) { LogText(ERROR, move(message)); }
+        template <same_as<string> Text>
+        void Warning(Text&& message) { LogText(WARNING, move(message)); }
+        template <same_as<string> Text>
+        void Notice(Text&& message) { LogText(NOTICE, move(message)); }
+        template <same_as<string> Text>
+        void Info(Text&& message) { LogText(INFO, move(message)); }
+        template <same_as<string> Text>
+        void Debug(Text&& message) { LogText(DEBUG, move(message)); }
+
+        bool IsEnabled(LogLevel level) const {
+            return level <= log_level_threshold_.load(memory_order_relaxed);
+        }
+        // Also true for records that only go into the flight recorder.
+        bool IsRecorded(LogLevel level) const {
+            return level <= record_level_threshold_.load(memory_order_relaxed);
+        }
+
+        LoggerStats GetStats();
+
+        // logger.Stream(WARNING) << "text" << value; the record is submitted
+        // when the statement ends.
+        RecordStream Stream(LogLevel level);
+
+        // Used by the LOG_*_LIMITED macros. The number of refused records is
+        // logged before the next admitted one, or by the logger thread once
+        // the run ends, on Flush() and when the logger closes.
+        bool IsWithinRate(LogLevel level, RateLimiter& limiter, const char* file, int line) {
+            return IsWithinRate(0, level, limiter, file, line);
+        }
+
+        // Writes a record logged elsewhere with its own timestamp; used by
+        // logcollector for the records of "shm=" loggers.
+        void LogRecord(LogLevel level, int64_t timestamp, string_view text) {
+            LogRecord(0, level, timestamp, text);
+        }
+
+        // Handle for the named category, e.g. "net.tls". Its level comes from
+        // the longest "cat=" prefix matching the name or one of its parents
+        // ("net"), and follows lev without one. Names are kept for the life
+        // of the logger; asking again for a name returns the same category.
+        LogCategory Category(const string& name);
+
+        template <typename Arg, typename... Args>
+        void Emergency(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(EMERGENCY, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Alert(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(ALERT, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Critical(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(CRITICAL, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Error(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(ERROR, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Warning(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(WARNING, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Notice(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(NOTICE, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Info(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(INFO, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Debug(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            LogFormatString(DEBUG, format.Get(), arg, args...);
+        }
+
+        // Enqueues the format id and the raw arguments; the text is only
+        // produced by the logger thread or, in binary mode, by logdecode.
+        template <typename... Args>
+        void LogFormat(LogLevel level, uint32_t format_id, const Args&... args) {
+            LogFormat(0, level, format_id, args...);
+        }
 
     private:
-        void Log(Message message);
-        void Log2(LogLevel level, const string& message);
+        friend class Backend;
+        friend class RecordStream;
+        friend class LogCategory;
+
+        // Resolved from the configuration whenever a category is created or
+        // the logger is reconfigured; producers only load the levels.
+        struct CategoryState
+        {
+            string name;
+            atomic_int level = INVALID;
+            atomic_int record_level = INVALID;
+            // Matched by a "cat=" prefix; such records bypass lev.
+            atomic_bool is_configured = false;
+        };
+
+        bool IsEnabled(LogLevel level, uint16_t category) const {
+            if (category == 0)
+                return IsEnabled(level);
+            return level <= categories_[category - 1]->level.load(memory_order_relaxed);
+        }
+        bool IsRecorded(LogLevel level, uint16_t category) const {
+            if (category == 0)
+                return IsRecorded(level);
+            return level <= categories_[category - 1]->record_level.load(memory_order_relaxed);
+        }
+
+        bool IsWithinRate(uint16_t category, LogLevel level, RateLimiter& limiter, const char* file, int line);
+        void LogRecord(uint16_t category, LogLevel level, int64_t timestamp, string_view text);
+
+        template <typename... Args>
+        void LogFormat(uint16_t category, LogLevel level, uint32_t format_id, const Args&... args) {
+            if (!IsEnabled(level, category)) {
+                RecordFiltered(category, level, format_id, args...);
+                return;
+            }
+            EnqueueFormat(category, level, format_id, args...);
+        }
+
+        template <typename... Args>
+        void LogFormatString(LogLevel level, const char* format, const Args&... args) {
+            LogFormatString(0, level, format, args...);
+        }
+
+        template <typename... Args>
+        void LogFormatString(uint16_t category, LogLevel level, const char* format, const Args&... args) {
+            if (!IsEnabled(level, category)) {
+                if (Config().flight_records > 0)
+                    RecordFiltered(category, level, FormatRegistry::Intern(format), args...);
+                else
+                    CountFiltered(level);
+                return;
+            }
+            EnqueueFormat(category, level, FormatRegistry::Intern(format), args...);
+        }
+
+        template <typename... Args>
+        static void EncodeMessage(Message& message, LogLevel level, uint32_t format_id, const Args&... args) {
+            message.level = level;
+            message.timestamp = TimestampNow();
+            message.format_id = format_id;
+            size_t size = ArgsSize(args...);
+            if (size <= Message::kInlineSize) {
+                EncodeArgs(message.inline_data, args...);
+                message.inline_size = static_cast<uint32_t>(size);
+            } else {
+                message.message.resize(size);
+                EncodeArgs(message.message.data(), args...);
+                message.inline_size = 0;
+            }
+        }
+
+        template <typename... Args>
+        void EnqueueFormat(uint16_t category, LogLevel level, uint32_t format_id, const Args&... args) {
+            Message message;
+            EncodeMessage(message, level, format_id, args...);
+            message.category = category;
+            if (Config().is_coalescing &&
+                IsRepeated(level, category, format_id, message.PayloadData(), message.PayloadSize()))
+                return;
+            Log(message);
+        }
+
+        // Producer counters, striped so that threads rarely share a cache line.
+        struct alignas(64) CounterStripe
+        {
+            atomic<uint64_t> accepted[LoggerStats::kLevels] = {};
+            atomic<uint64_t> filtered[LoggerStats::kLevels] = {};
+            atomic<uint64_t> dropped[LoggerStats::kLevels] = {};
+            atomic<uint64_t> suppressed[LoggerStats::kLevels] = {};
+        };
+
+        CounterStripe& GetCounterStripe() {
+            thread_local size_t stripe = next_counter_stripe_.fetch_add(1, memory_order_relaxed) % kCounterStripes;
+            return counter_stripes_[stripe];
+        }
+        void CountFiltered(LogLevel level) {
+            GetCounterStripe().filtered[level].fetch_add(1, memory_order_relaxed);
+        }
+
+        // "flight": a filtered record is encoded into the thread's flight
+        // recorder instead of being dropped.
+        template <typename... Args>
+        void RecordFiltered(uint16_t category, LogLevel level, uint32_t format_id, const Args&... args) {
+            CountFiltered(level);
+            if (Message* record = NextFlightRecord()) {
+                EncodeMessage(*record, level, format_id, args...);
+                record->category = category;
+            }
+        }
+        Message* NextFlightRecord();
+        void ReplayFlightRecords();
+
+        void LogText(LogLevel level, string_view text, uint16_t category = 0);
+        void LogText(LogLevel level, string&& text);
+        bool IsTextAccepted(LogLevel level, string_view text, uint16_t category = 0);
+        bool IsRepeated(LogLevel level, uint16_t category, uint32_t format_id, const char* data, size_t size);
+        RepeatState* GetRepeatState();
+        void EncodeRepeatReport(Message& message, RepeatState& state);
+        void ReportRepeats(bool is_forced);
+        void ReportRepeatsIfDue();
+        void ReportRateLimits(bool is_forced);
+        void ReportRateLimitsIfDue();
+        void Log(Message& message);
+        void LogToThreadQueue(Message& message);
+        void LogToSharedRing(const Message& message);
+        ThreadQueue* GetThreadQueue();
+        void WakeLoggerThread(size_t pending);
+        size_t PendingMessages();
+        bool HasPendingMessages();
+        bool IsFlushRequested() const {
+            return flush_requested_.load(memory_order_acquire) != flush_completed_.load(memory_order_acquire);
+        }
+        void Log2(const Message& message);
         void LoggerThread();
+        void PrepareConsumer();
+        bool ProcessBatch(unsigned int& timeout_ms);
+        void DrainBatch(vector<Message>& batch, bool is_hold_back_allowed = true);
+        void DrainThreadQueues(vector<Message>& batch, bool is_hold_back_allowed);
+        void DrainAll();
+        void CompleteFlush(uint64_t flush_requested);
+        void RefreshThreadQueues();
+        void WaitForMessages(size_t count, unsigned int timeout_ms);
+        void LogBatch(vector<Message>& batch);
+        void FlushSinks();
+        unsigned int FlushTimeout();
+        unsigned int WaitTimeout();
+        size_t QueueDepth();
+        void LogStatsIfDue();
+
+        uint64_t RequestFatalFlush();
+        bool IsConsumerThread() const;
+        static void InstallFatalHandlers();
+        static void FatalSignalHandler(int signal);
+        static void FatalTerminateHandler();
+        static void FlushAllForFatal();
 
         LogLevel& SetLogLevel(LogLevel& current_level, const int i);
         void Configure(LogConfig& temp_config, const string& config);
         void ConfigurationSetDefault(LogConfig& temp_config);
         LogConfig& ConfigurationCheck(LogConfig& temp_config);
+        size_t ParseSize(const string& value);
+        int64_t ParseDuration(const string& value);
+        void ConfigureSink(SinkConfig& sink_config, const string& spec);
+        SinkConfig GetPrimarySinkConfig(const LogConfig& config);
+        unique_ptr<Sink> CreateSink(const SinkConfig& sink_config);
+        bool IsArchiverNeeded(const LogConfig& config);
 
-        ostream& GetOutputStream();
-        string GetFilename();
-        const char* GetZipName(string& base_filename);
-        unsigned long file_size(const char *filename);
-        int compress_one_file(const char *infilename, const char *outfilename);
-        void ChangingLogFile();
+        struct SinkEntry
+        {
+            unique_ptr<Sink> sink;
+            // Passed to the constructor; kept when the logger is reconfigured.
+            bool is_custom = false;
+            // The lev= output, which writes "cat=" records at any level.
+            bool is_primary = false;
+            // Binary mode: segment the header was written for and the
+            // formats and categories already defined in it.
+            uint64_t binary_segment = UINT64_MAX;
+            vector<bool> defined_formats = {};
+            vector<bool> defined_categories = {};
+        };
 
-        string GetTimestamp();
-        string GetLogLevelString(LogLevel& level);
+        void WriteBinaryRecord(SinkEntry& entry, LogLevel level, uint32_t format_id, uint16_t category);
+        void CreateSinks(const LogConfig& config, vector<SinkEntry>& sinks);
+        void UpdateThreshold();
+        void ApplyPendingConfig();
+        void ResolveCategory(CategoryState& state);
 
-        ofstream file_stream_;
-        unsigned int file_number_;
-        LogConfig current_config_;
+        // Current snapshot; producers read it without locking.
+        const LogConfig& Config() const {
+            return *config_.load(memory_order_acquire);
+        }
+
+        unique_ptr<Archiver> archiver_;
+        vector<SinkEntry> sinks_;
+        // Guards sinks_ and archiver_ against GetStats() while the logger
+        // thread replaces them; the logger thread itself reads them freely.
+        mutex sinks_mutex_;
+        Sink::Stats retired_sink_stats_ = {};
+        string record_buffer_;
+        string binary_preamble_;
+        atomic<const LogConfig*> config_ = nullptr;
+        vector<unique_ptr<LogConfig>> configs_;
+        mutex reconfigure_mutex_;
+        atomic<const LogConfig*> pending_config_ = nullptr;
+        exception_ptr reconfigure_error_;
+        TimestampFormatter timestamp_formatter_;
         mutex mutex_;
         condition_variable condition_variable_;
-        queue<Message> messages_;
+        unique_ptr<RingBuffer<Message>> messages_;
+        // "shm=": records bypass the queues and the sinks.
+        unique_ptr<SharedRing> shared_ring_;
+        thread logger_thread_;
         atomic_bool is_logger_running = false;
-        atomic_bool is_logger_closed = false;
+        atomic_bool is_logger_thread_sleeping = false;
+        atomic<size_t> wake_threshold_ = 1;
+        atomic_int log_level_threshold_ = INVALID;
+        atomic_int record_level_threshold_ = INVALID;
+
+        // A record carries its category as a 16-bit index into categories_.
+        static constexpr size_t kMaxCategories = 1024;
+        mutex categories_mutex_;
+        unique_ptr<CategoryState> categories_[kMaxCategories];
+        size_t category_count_ = 0;
+
+        static atomic<uint64_t> next_logger_id_;
+        const uint64_t logger_id_ = next_logger_id_++;
+        // Set by the destructor; the threads' flight recorders share it and
+        // are dropped on their next lookup once it is set.
+        const shared_ptr<atomic_bool> is_logger_closed_ = make_shared<atomic_bool>(false);
+        mutex thread_queues_mutex_;
+        vector<shared_ptr<ThreadQueue>> thread_queues_;
+        atomic<uint64_t> thread_queues_version_ = 0;
+        mutex repeat_states_mutex_;
+        vector<shared_ptr<RepeatState>> repeat_states_;
+        // Next time the consumer looks for runs to report; reset to 0 when a
+        // thread starts coalescing.
+        atomic<int64_t> next_repeat_report_time_ = INT64_MAX;
+        mutex rate_limits_mutex_;
+        vector<RateLimitState> rate_limits_;
+        atomic<int64_t> next_rate_report_time_ = INT64_MAX;
+        // How long a suppressed count must stay unchanged to be reported (ns).
+        static constexpr int64_t kRateReportInterval = 1000000000;
+        // Logger thread's own copy of thread_queues_ and the merge heap.
+        vector<shared_ptr<ThreadQueue>> consumer_queues_;
+        uint64_t consumer_queues_version_ = 0;
+        vector<pair<int64_t, size_t>> merge_heap_;
+        bool is_merge_held_back_ = false;
+
+        Backend* backend_ = nullptr;
+        atomic_bool is_consumer_busy_ = false;
+        vector<Message> consumer_batch_;
+        static constexpr chrono::microseconds kMergeGrace{100};
+
+        static constexpr size_t kCounterStripes = 16;
+        static atomic<size_t> next_counter_stripe_;
+        CounterStripe counter_stripes_[kCounterStripes];
+        atomic<size_t> max_queue_depth_ = 0;
+        atomic<uint64_t> write_latency_[LoggerStats::kLatencyBuckets] = {};
+        chrono::steady_clock::time_point next_stats_time_;
+
+        atomic<uint64_t> flush_requested_ = 0;
+        atomic<uint64_t> flush_completed_ = 0;
+        condition_variable flush_condition_variable_;
+
+        // Loggers configured with "fatalflush", read by the signal handler.
+        static constexpr size_t kMaxFatalLoggers = 64;
+        static constexpr chrono::milliseconds kFatalFlushTimeout{2000};
+        static atomic<Logger*> fatal_loggers_[kMaxFatalLoggers];
+    };
+
+    // Builder returned by Logger::Stream(). Values are appended to a buffer
+    // owned by the thread, numbers with to_chars; the destructor hands the
+    // text to the logger as one record. A stream opened while another one is
+    // being built on the same thread uses a buffer of its own.
+    class RecordStream
+    {
+    public:
+        RecordStream(Logger& logger, LogLevel level, uint16_t category = 0);
+        ~RecordStream();
+
+        RecordStream(const RecordStream&) = delete;
+        RecordStream& operator=(const RecordStream&) = delete;
+
+        RecordStream& operator<<(string_view value) {
+            if (buffer_)
+                buffer_->append(value);
+            return *this;
+        }
+
+        RecordStream& operator<<(const char* value) {
+            return *this << string_view(value ? value : "(null)");
+        }
+
+        RecordStream& operator<<(char value) {
+            if (buffer_)
+                *buffer_ += value;
+            return *this;
+        }
+
+        RecordStream& operator<<(bool value) {
+            return *this << string_view(value ? "true" : "false");
+        }
+
+        RecordStream& operator<<(LogLevel value) {
+            return *this << string_view(LogLevelName(value));
+        }
+
+        template <typename T>
+            requires (is_arithmetic_v<T> && !is_same_v<T, bool> && !is_same_v<T, char>)
+        RecordStream& operator<<(T value) {
+            if (buffer_) {
+                char text[32];
+                auto result = to_chars(text, text + sizeof(text), value);
+                buffer_->append(text, result.ptr - text);
+            }
+            return *this;
+        }
+
+        RecordStream& operator<<(const void* value) {
+            if (buffer_) {
+                char text[24] = "0x";
+                auto result = to_chars(text + 2, text + sizeof(text), reinterpret_cast<uintptr_t>(value), 16);
+                buffer_->append(text, result.ptr - text);
+            }
+            return *this;
+        }
+
+        // std::endl and other manipulators: the record ends with the statement.
+        RecordStream& operator<<(ostream& (*)(ostream&)) {
+            return *this;
+        }
+
+        // Anything else with an ostream operator, through an ostringstream.
+        template <typename T>
+            requires (!is_arithmetic_v<T> && !is_pointer_v<T> && !is_convertible_v<const T&, string_view> &&
+                      requires(ostream& out, const T& value) { out << value; })
+        RecordStream& operator<<(const T& value) {
+            if (buffer_) {
+                ostringstream out;
+                out << value;
+                *buffer_ += out.str();
+            }
+            return *this;
+        }
+
+    private:
+        Logger& logger_;
+        LogLevel level_;
+        uint16_t category_;
+        // Null when the level is disabled.
+        string* buffer_ = nullptr;
+        string own_buffer_;
+    };
+
+    inline RecordStream Logger::Stream(LogLevel level) {
+        return RecordStream(*this, level);
+    }
+
+    // Turns the stream expression of LOG_STREAM into void, so that both arms
+    // of its conditional have the same type; & binds looser than <<.
+    struct RecordStreamVoidify
+    {
+        void operator&(const RecordStream&) const {}
+    };
+
+    // logger << WARNING << "text" << value;
+    inline RecordStream operator<<(Logger& logger, LogLevel level) {
+        return logger.Stream(level);
+    }
+
+    // Returned by Logger::Category(); cheap to copy and valid as long as its
+    // logger. Offers the logging calls of Logger, so the LOG_* macros accept
+    // a category in place of a logger. Its records go through the logger's
+    // queue and are written as "[LEVEL:name]".
+    class LogCategory
+    {
+    public:
+        const string& Name() const { return state_->name; }
+
+        bool IsEnabled(LogLevel level) const {
+            return level <= state_->level.load(memory_order_relaxed);
+        }
+        bool IsRecorded(LogLevel level) const {
+            return level <= state_->record_level.load(memory_order_relaxed);
+        }
+
+        void Emergency(string_view message) { logger_->LogText(EMERGENCY, message, id_); }
+        void Alert(string_view message) { logger_->LogText(ALERT, message, id_); }
+        void Critical(string_view message) { logger_->LogText(CRITICAL, message, id_); }
+        void Error(string_view message) { logger_->LogText(ERROR, message, id_); }
+        void Warning(string_view message) { logger_->LogText(WARNING, message, id_); }
+        void Notice(string_view message) { logger_->LogText(NOTICE, message, id_); }
+        void Info(string_view message) { logger_->LogText(INFO, message, id_); }
+        void Debug(string_view message) { logger_->LogText(DEBUG, message, id_); }
+
+        template <typename Arg, typename... Args>
+        void Emergency(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, EMERGENCY, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Alert(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, ALERT, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Critical(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, CRITICAL, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Error(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, ERROR, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Warning(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, WARNING, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Notice(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, NOTICE, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Info(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, INFO, format.Get(), arg, args...);
+        }
+        template <typename Arg, typename... Args>
+        void Debug(FormatString<Arg, Args...> format, const Arg& arg, const Args&... args) {
+            logger_->LogFormatString(id_, DEBUG, format.Get(), arg, args...);
+        }
+
+        template <typename... Args>
+        void LogFormat(LogLevel level, uint32_t format_id, const Args&... args) {
+            logger_->LogFormat(id_, level, format_id, args...);
+        }
+
+        bool IsWithinRate(LogLevel level, RateLimiter& limiter, const char* file, int line) {
+            return logger_->IsWithinRate(id_, level, limiter, file, line);
+        }
+
+        RecordStream Stream(LogLevel level) {
+            return RecordStream(*logger_, level, id_);
+        }
+
+        // As Logger::LogRecord(); used by logcollector for records logged
+        // through a category of a "shm=" logger.
+        void LogRecord(LogLevel level, int64_t timestamp, string_view text) {
+            logger_->LogRecord(id_, level, timestamp, text);
+        }
+
+    private:
+        friend class Logger;
+
+        LogCategory(Logger& logger, Logger::CategoryState& state, uint16_t id)
+            : logger_(&logger), state_(&state), id_(id) {}
+
+        Logger* logger_;
+        Logger::CategoryState* state_;
+        uint16_t id_;
     };
+
+    // category << WARNING << "text" << value;
+    inline RecordStream operator<<(LogCategory& category, LogLevel level) {
+        return category.Stream(level);
+    }
 }
+
+// Compile-time ceiling for the LOG_* macros: call sites above it are removed
+// together with the evaluation of their arguments.
+#ifndef LOGGER_MAX_LEVEL
+#ifdef NDEBUG
+#define LOGGER_MAX_LEVEL 6
+#else
+#define LOGGER_MAX_LEVEL 8
+#endif
+#endif
+
+#define LOGGER_CALL(logger_ref, level, method, ...) \
+    do { \
+        if constexpr (logger::level <= LOGGER_MAX_LEVEL) { \
+            if ((logger_ref).IsRecorded(logger::level)) \
+                (logger_ref).method(__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_EMERGENCY(logger_ref, ...) LOGGER_CALL(logger_ref, EMERGENCY, Emergency, __VA_ARGS__)
+#define LOG_ALERT(logger_ref, ...) LOGGER_CALL(logger_ref, ALERT, Alert, __VA_ARGS__)
+#define LOG_CRITICAL(logger_ref, ...) LOGGER_CALL(logger_ref, CRITICAL, Critical, __VA_ARGS__)
+#define LOG_ERROR(logger_ref, ...) LOGGER_CALL(logger_ref, ERROR, Error, __VA_ARGS__)
+#define LOG_WARNING(logger_ref, ...) LOGGER_CALL(logger_ref, WARNING, Warning, __VA_ARGS__)
+#define LOG_NOTICE(logger_ref, ...) LOGGER_CALL(logger_ref, NOTICE, Notice, __VA_ARGS__)
+#define LOG_INFO(logger_ref, ...) LOGGER_CALL(logger_ref, INFO, Info, __VA_ARGS__)
+#define LOG_DEBUG(logger_ref, ...) LOGGER_CALL(logger_ref, DEBUG, Debug, __VA_ARGS__)
+
+// Like LOGGER_CALL, but the call site logs at most per_second records a
+// second, in bursts of up to one second's worth. The limit is shared by all
+// threads and loggers going through the call site.
+#define LOGGER_LIMITED_CALL(logger_ref, level, method, per_second, ...) \
+    do { \
+        if constexpr (logger::level <= LOGGER_MAX_LEVEL) { \
+            if ((logger_ref).IsEnabled(logger::level)) { \
+                static logger::RateLimiter logger_rate_limiter(per_second, per_second); \
+                if ((logger_ref).IsWithinRate(logger::level, logger_rate_limiter, __FILE__, __LINE__)) \
+                    (logger_ref).method(__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_EMERGENCY_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, EMERGENCY, Emergency, per_second, __VA_ARGS__)
+#define LOG_ALERT_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, ALERT, Alert, per_second, __VA_ARGS__)
+#define LOG_CRITICAL_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, CRITICAL, Critical, per_second, __VA_ARGS__)
+#define LOG_ERROR_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, ERROR, Error, per_second, __VA_ARGS__)
+#define LOG_WARNING_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, WARNING, Warning, per_second, __VA_ARGS__)
+#define LOG_NOTICE_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, NOTICE, Notice, per_second, __VA_ARGS__)
+#define LOG_INFO_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, INFO, Info, per_second, __VA_ARGS__)
+#define LOG_DEBUG_LIMITED(logger_ref, per_second, ...) LOGGER_LIMITED_CALL(logger_ref, DEBUG, Debug, per_second, __VA_ARGS__)
+
+// LOG_STREAM(logger, WARNING) << "text" << value; nothing after the macro is
+// evaluated when the level is off. A single expression, so that it is safe
+// as the body of an unbraced if with an else.
+#define LOG_STREAM(logger_ref, level) \
+    (logger::level > LOGGER_MAX_LEVEL || !(logger_ref).IsRecorded(logger::level)) \
+        ? (void)0 : logger::RecordStreamVoidify() & (logger_ref).Stream(logger::level)
+
+// Registers the format string literal once per call site.
+#define LOGGER_FORMAT_ID(format) \
+    ([]() -> uint32_t { static const uint32_t id = logger::FormatRegistry::Register(format); return id; }())
+
+#define LOG_FORMAT(logger_ref, level, format, ...) \
+    do { \
+        if constexpr (logger::level <= LOGGER_MAX_LEVEL) { \
+            if ((logger_ref).IsRecorded(logger::level)) \
+                (logger_ref).LogFormat(logger::level, LOGGER_FORMAT_ID(format) __VA_OPT__(,) __VA_ARGS__); \
+        } \
+    } while (0)
 #endif
@@ -0,0 +1,362 @@
+// Prints the records of log segments that fall into a time range and pass a
+// level filter. Segments written with the "index" option have a "<file>.idx"
+// sidecar: segments outside the range or without records of a wanted level
+// are skipped from it, and only the blocks covering the range are read (and
+// inflated, for gzipped segments). Other segments are scanned in full.
+// Segments are scanned in parallel; the output keeps the order of the
+// arguments.
+//
+// Usage: logquery [--from TIME] [--to TIME] [--level N] [--jobs N] <segment>...
+// TIME is "YYYY-MM-DD HH:MM:SS" in local time or "@<unix seconds>"; the
+// range includes --from and excludes --to. --level N keeps records with a
+// level up to N, as lev=N does.
+#include "binary_log.hpp"
+#include "logger.hpp"
+#include <fcntl.h>
+#include <future>
+#include <unistd.h>
+
+using namespace logger;
+
+namespace {
+    struct Query
+    {
+        int64_t from = INT64_MIN;
+        int64_t to = INT64_MAX;
+        int level = DEBUG;
+        // Bounds as the logger prints them with date and time, for the
+        // lines of text segments.
+        string from_text;
+        string to_text;
+    };
+
+    struct Result
+    {
+        string out;
+        string error;
+    };
+
+    bool ParseTime(const string& value, int64_t& timestamp) {
+        if (!value.empty() && value[0] == '@') {
+            try {
+                timestamp = stoll(value.substr(1)) * 1000000000;
+                return true;
+            } catch (exception&) {
+                return false;
+            }
+        }
+        tm local_time = {};
+        const char* end = strptime(value.c_str(), "%Y-%m-%d %H:%M:%S", &local_time);
+        if (!end || *end)
+            return false;
+        local_time.tm_isdst = -1;
+        timestamp = static_cast<int64_t>(mktime(&local_time)) * 1000000000;
+        return true;
+    }
+
+    string FormatBound(int64_t timestamp) {
+        TimestampFormatter timestamp_formatter;
+        timestamp_formatter.Configure(true, true);
+        char buffer[TimestampFormatter::kMaxLength];
+        size_t length = timestamp_formatter.Format(timestamp, buffer);
+        return string(buffer, length);
+    }
+
+    // Level of a "[LEVEL] " or "[LEVEL:category] " prefix within the first
+    // few dozen bytes, or INVALID for lines that have none.
+    LogLevel ParseLevel(string_view line) {
+        size_t open = line.find('[');
+        if (open == string_view::npos || open > TimestampFormatter::kMaxLength)
+            return INVALID;
+        size_t close = line.find(']', open);
+        if (close == string_view::npos)
+            return INVALID;
+        string_view name = line.substr(open + 1, close - open - 1);
+        name = name.substr(0, name.find(':'));
+        for (int level = EMERGENCY; level <= DEBUG; level++) {
+            if (name == LogLevelName(static_cast<LogLevel>(level)))
+                return static_cast<LogLevel>(level);
+        }
+        return INVALID;
+    }
+
+    // Filters the lines of text segments. A line without a level prefix
+    // continues the record before it and shares its fate; a record without
+    // a date and time can only be placed by the block it is in.
+    class LineFilter
+    {
+    public:
+        explicit LineFilter(const Query& query) : query_(query) {}
+
+        void Add(string_view text, string& out) {
+            if (!partial_.empty()) {
+                size_t end = text.find('\n');
+                if (end == string_view::npos) {
+                    partial_.append(text);
+                    return;
+                }
+                partial_.append(text.substr(0, end + 1));
+                AddLine(partial_, out);
+                partial_.clear();
+                text.remove_prefix(end + 1);
+            }
+            size_t begin = 0;
+            size_t end;
+            while ((end = text.find('\n', begin)) != string_view::npos) {
+                AddLine(text.substr(begin, end - begin + 1), out);
+                begin = end + 1;
+            }
+            partial_.append(text.substr(begin));
+        }
+
+        void Finish(string& out) {
+            if (!partial_.empty()) {
+                partial_ += '\n';
+                AddLine(partial_, out);
+                partial_.clear();
+            }
+        }
+
+    private:
+        void AddLine(string_view line, string& out) {
+            LogLevel level = ParseLevel(line);
+            if (level != INVALID) {
+                is_matching_ = level <= query_.level;
+                // "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" sorts like the time it stands for.
+                const size_t length = query_.from_text.size() - 1;
+                if (is_matching_ && line.size() > length && line[4] == '-' && line[10] == ' ') {
+                    string_view time = line.substr(0, length);
+                    is_matching_ = time >= string_view(query_.from_text).substr(0, length) &&
+                        time < string_view(query_.to_text).substr(0, length);
+                }
+            }
+            if (is_matching_)
+                out.append(line);
+        }
+
+        const Query& query_;
+        string partial_;
+        bool is_matching_ = false;
+    };
+
+    bool IsBinarySegment(gzFile file) {
+        char header[1 + sizeof(binary::kMagic)];
+        bool is_binary = gzread(file, header, sizeof(header)) == sizeof(header) &&
+            header[0] == binary::SEGMENT_HEADER && memcmp(header + 1, binary::kMagic, sizeof(binary::kMagic)) == 0;
+        gzrewind(file);
+        return is_binary;
+    }
+
+    void ScanFull(const string& filename, const Query& query, Result& result) {
+        gzFile file = gzopen(filename.c_str(), "rb");
+        if (!file) {
+            result.error = "cannot open";
+            return;
+        }
+        gzbuffer(file, 256 * 1024);
+        if (IsBinarySegment(file)) {
+            bool is_decoded = binary::DecodeSegment(file, [&](uint8_t level, int64_t timestamp, const string& line) {
+                if (level <= query.level && timestamp >= query.from && timestamp < query.to)
+                    result.out += line;
+            });
+            if (!is_decoded)
+                result.error = "not a binary log or corrupted segment";
+        } else {
+            LineFilter filter(query);
+            vector<char> buffer(256 * 1024);
+            int count;
+            while ((count = gzread(file, buffer.data(), buffer.size())) > 0)
+                filter.Add(string_view(buffer.data(), count), result.out);
+            filter.Finish(result.out);
+            if (count < 0)
+                result.error = "read error";
+        }
+        gzclose(file);
+    }
+
+    bool ReadPlain(int fd, uint64_t begin, uint64_t end, LineFilter& filter, string& out) {
+        vector<char> buffer(256 * 1024);
+        while (begin < end) {
+            ssize_t count = pread(fd, buffer.data(), min<uint64_t>(buffer.size(), end - begin), begin);
+            if (count < 0)
+                return false;
+            if (count == 0)
+                break;
+            filter.Add(string_view(buffer.data(), count), out);
+            begin += count;
+        }
+        return true;
+    }
+
+    // Inflates from compressed_offset until size bytes are produced or the
+    // deflate stream ends. window_bits selects a gzip stream (block 0) or
+    // raw deflate data (a restart point).
+    bool ReadCompressed(int fd, uint64_t compressed_offset, int window_bits, uint64_t size,
+                        LineFilter& filter, string& out) {
+        z_stream stream = {};
+        if (inflateInit2(&stream, window_bits) != Z_OK)
+            return false;
+        vector<unsigned char> input(64 * 1024);
+        vector<char> output(256 * 1024);
+        uint64_t offset = compressed_offset;
+        int status = Z_OK;
+        bool is_ok = true;
+        while (size > 0 && status != Z_STREAM_END) {
+            if (stream.avail_in == 0) {
+                ssize_t count = pread(fd, input.data(), input.size(), offset);
+                if (count <= 0) {
+                    is_ok = count == 0;
+                    break;
+                }
+                offset += count;
+                stream.next_in = input.data();
+                stream.avail_in = count;
+            }
+            stream.next_out = reinterpret_cast<unsigned char*>(output.data());
+            stream.avail_out = min<uint64_t>(output.size(), size);
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                is_ok = false;
+                break;
+            }
+            size_t produced = reinterpret_cast<char*>(stream.next_out) - output.data();
+            filter.Add(string_view(output.data(), produced), out);
+            size -= produced;
+        }
+        inflateEnd(&stream);
+        return is_ok;
+    }
+
+    void ScanSegment(const string& filename, const Query& query, Result& result) {
+        SegmentIndex index;
+        if (!index.Read(filename + ".idx") || index.base_offset != 0 || index.blocks.empty()) {
+            ScanFull(filename, query, result);
+            return;
+        }
+        if (index.first_timestamp >= query.to || index.last_timestamp < query.from)
+            return;
+        uint64_t level_count = 0;
+        for (int level = 0; level <= query.level && level < static_cast<int>(SegmentIndex::kLevels); level++)
+            level_count += index.level_counts[level];
+        if (level_count == 0)
+            return;
+
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            result.error = "cannot open";
+            return;
+        }
+        gzFile file = gzdopen(dup(fd), "rb");
+        bool is_binary = file && IsBinarySegment(file);
+        if (file)
+            gzclose(file);
+        // Binary records need the format definitions from the start of the segment.
+        if (is_binary) {
+            close(fd);
+            ScanFull(filename, query, result);
+            return;
+        }
+
+        // Runs of consecutive blocks that overlap the range.
+        const vector<SegmentIndex::Block>& blocks = index.blocks;
+        LineFilter filter(query);
+        bool is_ok = true;
+        size_t i = 0;
+        while (i < blocks.size() && is_ok) {
+            bool is_overlapping = blocks[i].timestamp < query.to &&
+                (i + 1 == blocks.size() || blocks[i + 1].timestamp >= query.from);
+            if (!is_overlapping) {
+                i++;
+                continue;
+            }
+            size_t first = i;
+            while (i + 1 < blocks.size() && blocks[i + 1].timestamp < query.to)
+                i++;
+            size_t last = ++i;
+            uint64_t end = last < blocks.size() ? blocks[last].offset : UINT64_MAX;
+            if (!index.is_compressed) {
+                is_ok = ReadPlain(fd, blocks[first].offset, end, filter, result.out);
+            } else {
+                int window_bits = first == 0 ? 15 + 16 : -15;
+                is_ok = ReadCompressed(fd, blocks[first].compressed_offset, window_bits,
+                                       end - blocks[first].offset, filter, result.out);
+            }
+            filter.Finish(result.out);
+        }
+        close(fd);
+        if (!is_ok)
+            result.error = "read error";
+    }
+
+    bool ParseOptions(int argc, char* argv[], Query& query, size_t& jobs, vector<string>& segments) {
+        bool is_from_set = false;
+        bool is_to_set = false;
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0) {
+                segments.push_back(arg);
+                continue;
+            }
+            if (i + 1 >= argc)
+                return false;
+            string value = argv[++i];
+            try {
+                if (arg == "--from")
+                    is_from_set = ParseTime(value, query.from);
+                else if (arg == "--to")
+                    is_to_set = ParseTime(value, query.to);
+                else if (arg == "--level")
+                    query.level = stoi(value);
+                else if (arg == "--jobs")
+                    jobs = max(1, stoi(value));
+                else
+                    return false;
+            } catch (exception&) {
+                return false;
+            }
+            if ((arg == "--from" && !is_from_set) || (arg == "--to" && !is_to_set))
+                return false;
+        }
+        query.from_text = FormatBound(is_from_set ? query.from : 0);
+        query.to_text = is_to_set ? FormatBound(query.to) : string(TimestampFormatter::kMaxLength, '~');
+        return !segments.empty();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Query query;
+    size_t jobs = max(1u, thread::hardware_concurrency());
+    vector<string> segments;
+    if (!ParseOptions(argc, argv, query, jobs, segments)) {
+        cerr << "Usage: " << argv[0] << " [--from TIME] [--to TIME] [--level N] [--jobs N] <segment>..." << endl
+             << "TIME is \"YYYY-MM-DD HH:MM:SS\" (local time) or \"@<unix seconds>\"" << endl;
+        return 2;
+    }
+
+    vector<promise<Result>> promises(segments.size());
+    atomic<size_t> next_segment = 0;
+    vector<thread> workers;
+    for (size_t t = 0; t < min(jobs, segments.size()); t++) {
+        workers.emplace_back([&] {
+            size_t i;
+            while ((i = next_segment.fetch_add(1)) < segments.size()) {
+                Result result;
+                ScanSegment(segments[i], query, result);
+                promises[i].set_value(move(result));
+            }
+        });
+    }
+
+    int exit_code = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        Result result = promises[i].get_future().get();
+        fwrite(result.out.data(), 1, result.out.size(), stdout);
+        if (!result.error.empty()) {
+            cerr << segments[i] << ": " << result.error << endl;
+            exit_code = 1;
+        }
+    }
+    for (thread& worker : workers)
+        worker.join();
+    return exit_code;
+}
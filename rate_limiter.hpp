@@ -0,0 +1,58 @@
+#ifndef _RATE_LIMITER_HPP_
+#define _RATE_LIMITER_HPP_
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace logger {
+    using namespace std;
+
+    // Token bucket kept as a single "theoretical arrival time" (GCRA): each
+    // admitted record moves it one interval ahead, and a record is refused
+    // while that time runs more than a full bucket ahead of now. One CAS per
+    // admitted record, one fetch_add per refused one.
+    class RateLimiter
+    {
+    public:
+        RateLimiter(double per_second, double burst)
+            : interval_ns_(static_cast<int64_t>(1e9 / max(per_second, 1e-9))),
+              tolerance_ns_(static_cast<int64_t>(max(burst, 1.0) * interval_ns_)) {}
+
+        // On success returns the number of records refused since the last
+        // admitted one in suppressed; on refusal, that number including this
+        // record.
+        bool TryAcquire(uint64_t& suppressed) {
+            int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t arrival = arrival_ns_.load(memory_order_relaxed);
+            while (true) {
+                int64_t next = max(arrival, now) + interval_ns_;
+                if (next - now > tolerance_ns_) {
+                    suppressed = suppressed_.fetch_add(1, memory_order_relaxed) + 1;
+                    return false;
+                }
+                if (arrival_ns_.compare_exchange_weak(arrival, next, memory_order_relaxed))
+                    break;
+            }
+            suppressed = suppressed_.load(memory_order_relaxed) ? suppressed_.exchange(0, memory_order_relaxed) : 0;
+            return true;
+        }
+
+        uint64_t Suppressed() const {
+            return suppressed_.load(memory_order_relaxed);
+        }
+
+        // For reports written while no record is admitted.
+        uint64_t TakeSuppressed() {
+            return suppressed_.exchange(0, memory_order_relaxed);
+        }
+
+    private:
+        const int64_t interval_ns_;
+        const int64_t tolerance_ns_;
+        atomic<int64_t> arrival_ns_ = 0;
+        atomic<uint64_t> suppressed_ = 0;
+    };
+}
+#endif
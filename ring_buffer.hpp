@@ -0,0 +1,185 @@
+#ifndef _RING_BUFFER_HPP_
+#define _RING_BUFFER_HPP_
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace logger {
+    using namespace std;
+
+    enum OverflowPolicy
+    {
+        BLOCK = 0, DROP_NEWEST, OVERWRITE_OLDEST
+    };
+
+    // Bounded lock-free queue (D. Vyukov's sequence-per-cell scheme).
+    // Any number of producers; the consumer side is also safe for several
+    // threads, which lets producers discard the oldest cell on overflow.
+    template <typename T>
+    class RingBuffer
+    {
+    public:
+        static constexpr size_t kCacheLine = 64;
+
+        explicit RingBuffer(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity)
+                size <<= 1;
+            mask_ = size - 1;
+            cells_.reset(new Cell[size]);
+            for (size_t i = 0; i < size; i++)
+                cells_[i].sequence.store(i, memory_order_relaxed);
+            enqueue_pos_.store(0, memory_order_relaxed);
+            dequeue_pos_.store(0, memory_order_relaxed);
+        }
+
+        RingBuffer(const RingBuffer&) = delete;
+        RingBuffer& operator=(const RingBuffer&) = delete;
+
+        // Moves from value only when the push succeeded.
+        bool TryPush(T& value) {
+            Cell* cell;
+            size_t pos = enqueue_pos_.load(memory_order_relaxed);
+            while (true) {
+                cell = &cells_[pos & mask_];
+                size_t sequence = cell->sequence.load(memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if (diff == 0) {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos_.load(memory_order_relaxed);
+                }
+            }
+            cell->value = move(value);
+            cell->sequence.store(pos + 1, memory_order_release);
+            return true;
+        }
+
+        bool TryPop(T& value) {
+            Cell* cell;
+            size_t pos = dequeue_pos_.load(memory_order_relaxed);
+            while (true) {
+                cell = &cells_[pos & mask_];
+                size_t sequence = cell->sequence.load(memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = dequeue_pos_.load(memory_order_relaxed);
+                }
+            }
+            value = move(cell->value);
+            cell->sequence.store(pos + mask_ + 1, memory_order_release);
+            return true;
+        }
+
+        bool Empty() const {
+            size_t pos = dequeue_pos_.load(memory_order_acquire);
+            return cells_[pos & mask_].sequence.load(memory_order_acquire) != pos + 1;
+        }
+
+        // Approximate: counts cells claimed by producers but not yet published.
+        size_t Size() const {
+            size_t tail = dequeue_pos_.load(memory_order_acquire);
+            size_t head = enqueue_pos_.load(memory_order_acquire);
+            return head > tail ? head - tail : 0;
+        }
+
+        size_t Capacity() const {
+            return mask_ + 1;
+        }
+
+    private:
+        struct alignas(kCacheLine) Cell
+        {
+            atomic<size_t> sequence;
+            T value;
+        };
+
+        unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        alignas(kCacheLine) atomic<size_t> enqueue_pos_;
+        alignas(kCacheLine) atomic<size_t> dequeue_pos_;
+    };
+
+    // Bounded single-producer/single-consumer queue. Each side keeps a
+    // private copy of the other side's index and only rereads the shared one
+    // when the copy says the queue is full (or empty).
+    template <typename T>
+    class SpscQueue
+    {
+    public:
+        static constexpr size_t kCacheLine = 64;
+
+        explicit SpscQueue(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity)
+                size <<= 1;
+            mask_ = size - 1;
+            slots_.reset(new Slot[size]);
+        }
+
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+
+        // Producer side. Moves from value only when the push succeeded.
+        bool TryPush(T& value) {
+            size_t head = head_.load(memory_order_relaxed);
+            if (head - cached_tail_ > mask_) {
+                cached_tail_ = tail_.load(memory_order_acquire);
+                if (head - cached_tail_ > mask_)
+                    return false;
+            }
+            slots_[head & mask_].value = move(value);
+            head_.store(head + 1, memory_order_release);
+            return true;
+        }
+
+        // Consumer side: the oldest element, or nullptr when empty.
+        T* Front() {
+            size_t tail = tail_.load(memory_order_relaxed);
+            if (tail == cached_head_) {
+                cached_head_ = head_.load(memory_order_acquire);
+                if (tail == cached_head_)
+                    return nullptr;
+            }
+            return &slots_[tail & mask_].value;
+        }
+
+        void Pop() {
+            tail_.store(tail_.load(memory_order_relaxed) + 1, memory_order_release);
+        }
+
+        bool Empty() const {
+            return head_.load(memory_order_acquire) == tail_.load(memory_order_acquire);
+        }
+
+        size_t Size() const {
+            size_t tail = tail_.load(memory_order_acquire);
+            size_t head = head_.load(memory_order_acquire);
+            return head > tail ? head - tail : 0;
+        }
+
+    private:
+        // Keeps the slot being written off the line the consumer reads.
+        struct alignas(kCacheLine) Slot
+        {
+            T value;
+        };
+
+        unique_ptr<Slot[]> slots_;
+        size_t mask_;
+        alignas(kCacheLine) atomic<size_t> head_{0};
+        size_t cached_tail_ = 0;
+        alignas(kCacheLine) atomic<size_t> tail_{0};
+        size_t cached_head_ = 0;
+    };
+}
+#endif
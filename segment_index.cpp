@@ -0,0 +1,92 @@
+#include "segment_index.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+using namespace logger;
+
+void SegmentIndex::AddRecord(uint8_t level, int64_t timestamp, uint64_t offset) {
+    if (Empty())
+        first_timestamp = timestamp;
+    last_timestamp = timestamp;
+    if (level < kLevels)
+        level_counts[level]++;
+
+    if (blocks.empty()) {
+        blocks.push_back({timestamp, offset, 0});
+    } else if (is_compressed) {
+        if (is_restart_pending_ && offset >= restart_.offset) {
+            blocks.push_back({timestamp, restart_.offset, restart_.compressed_offset});
+            is_restart_pending_ = false;
+        }
+    } else if (offset - blocks.back().offset >= kBlockSize) {
+        blocks.push_back({timestamp, offset, offset});
+    }
+}
+
+void SegmentIndex::AddRestart(uint64_t offset, uint64_t compressed_offset) {
+    is_restart_pending_ = true;
+    restart_ = {0, offset, compressed_offset};
+}
+
+void SegmentIndex::Clear() {
+    *this = SegmentIndex();
+}
+
+// Written under a temporary name and renamed, so that a reader never sees
+// half of an index.
+bool SegmentIndex::Write(const string& filename) const {
+    string temp_filename = filename + ".tmp";
+    {
+        ofstream out(temp_filename, ios::out | ios::trunc);
+        out << "logidx 1\n"
+            << "compressed " << is_compressed << "\n"
+            << "base " << base_offset << "\n"
+            << "first " << first_timestamp << "\n"
+            << "last " << last_timestamp << "\n"
+            << "levels";
+        for (uint64_t count : level_counts)
+            out << ' ' << count;
+        out << "\n";
+        for (const Block& block : blocks)
+            out << "block " << block.timestamp << ' ' << block.offset << ' ' << block.compressed_offset << "\n";
+        out.close();
+        if (out.fail()) {
+            remove(temp_filename.c_str());
+            return false;
+        }
+    }
+    return rename(temp_filename.c_str(), filename.c_str()) == 0;
+}
+
+bool SegmentIndex::Read(const string& filename) {
+    Clear();
+    ifstream in(filename);
+    string line;
+    if (!getline(in, line) || line != "logidx 1")
+        return false;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string key;
+        fields >> key;
+        if (key == "compressed") {
+            fields >> is_compressed;
+        } else if (key == "base") {
+            fields >> base_offset;
+        } else if (key == "first") {
+            fields >> first_timestamp;
+        } else if (key == "last") {
+            fields >> last_timestamp;
+        } else if (key == "levels") {
+            for (uint64_t& count : level_counts)
+                fields >> count;
+        } else if (key == "block") {
+            Block block;
+            fields >> block.timestamp >> block.offset >> block.compressed_offset;
+            blocks.push_back(block);
+        }
+        if (fields.fail())
+            return false;
+    }
+    return true;
+}
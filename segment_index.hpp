@@ -0,0 +1,60 @@
+#ifndef _SEGMENT_INDEX_HPP_
+#define _SEGMENT_INDEX_HPP_
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace logger {
+    using namespace std;
+
+    // Sidecar index of one log file, written next to it as "<file>.idx" by
+    // file sinks with the "index" option and read by logquery.
+    //
+    // Offsets count the bytes the sink wrote since it opened the file;
+    // base_offset is the size the file already had then, and the index only
+    // locates records when it is 0. A block is a run of whole records: in a
+    // plain file it starts at its offset, in a compressed one at a full-flush
+    // restart point whose raw deflate data begins at compressed_offset.
+    // Block 0 of a compressed file is the start of its gzip stream.
+    struct SegmentIndex
+    {
+        static constexpr uint64_t kBlockSize = 64 * 1024;
+        static constexpr size_t kLevels = 9;
+
+        struct Block
+        {
+            int64_t timestamp;
+            uint64_t offset;
+            uint64_t compressed_offset;
+        };
+
+        bool is_compressed = false;
+        uint64_t base_offset = 0;
+        int64_t first_timestamp = 0;
+        int64_t last_timestamp = 0;
+        uint64_t level_counts[kLevels] = {};
+        vector<Block> blocks;
+
+        bool Empty() const {
+            return last_timestamp == 0;
+        }
+
+        // Counts a record starting at offset. In a plain file a new block
+        // starts every kBlockSize bytes; in a compressed one at the record
+        // following a restart point.
+        void AddRecord(uint8_t level, int64_t timestamp, uint64_t offset);
+        // Compressed files: all bytes up to offset are flushed, the stream
+        // can be restarted at compressed_offset.
+        void AddRestart(uint64_t offset, uint64_t compressed_offset);
+        void Clear();
+
+        bool Write(const string& filename) const;
+        bool Read(const string& filename);
+
+    private:
+        bool is_restart_pending_ = false;
+        Block restart_ = {};
+    };
+}
+#endif
@@ -0,0 +1,226 @@
+#include "shared_ring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace logger;
+
+namespace {
+    // "LOGSHM" and the layout version; stored last when a ring is created.
+    constexpr uint64_t kMagic = 0x4c4f4753484d0002;
+}
+
+struct SharedRing::Header
+{
+    atomic<uint64_t> magic;
+    uint64_t capacity;
+    int64_t pid;
+    atomic<uint32_t> is_closed;
+    alignas(64) atomic<uint64_t> head;
+    alignas(64) atomic<uint64_t> tail;
+};
+
+// A record takes one slot per 484 bytes of category name and text, stored
+// one after the other. Only its first slot says how many slots and how long
+// the name is; the producer publishes that one last.
+struct SharedRing::Slot
+{
+    atomic<uint64_t> sequence;
+    uint32_t slots;
+    uint32_t size;
+    int64_t timestamp;
+    uint16_t level;
+    uint16_t category_size;
+    char text[kSlotSize - 28];
+};
+
+SharedRing::SharedRing(const string& name, int fd, void* data, size_t size)
+    : name_(name), fd_(fd), size_(size), header_(static_cast<Header*>(data)),
+      slots_(reinterpret_cast<Slot*>(static_cast<char*>(data) + sizeof(Header))),
+      mask_(header_->capacity - 1) {
+    static_assert(sizeof(Slot) == kSlotSize);
+}
+
+SharedRing::~SharedRing() {
+    munmap(header_, size_);
+    close(fd_);
+}
+
+// A ring left under the same name by an earlier process with this pid is
+// replaced; the collector notices and drains what it still holds.
+unique_ptr<SharedRing> SharedRing::Create(const string& name, size_t capacity) {
+    uint64_t slot_count = 2;
+    while (slot_count < capacity)
+        slot_count <<= 1;
+    string path = "/" + name;
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+    size_t size = sizeof(Header) + slot_count * sizeof(Slot);
+    void* data = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        close(fd);
+        shm_unlink(path.c_str());
+        return nullptr;
+    }
+
+    Header* header = new (data) Header();
+    header->capacity = slot_count;
+    header->pid = getpid();
+    unique_ptr<SharedRing> ring(new SharedRing(name, fd, data, size));
+    for (uint64_t i = 0; i < slot_count; i++) {
+        Slot* slot = new (&ring->slots_[i]) Slot();
+        slot->sequence.store(i, memory_order_relaxed);
+    }
+    header->magic.store(kMagic, memory_order_release);
+    return ring;
+}
+
+bool SharedRing::TryPush(uint32_t level, int64_t timestamp, string_view category, string_view text) {
+    constexpr size_t kTextSize = sizeof(Slot::text);
+    thread_local string joined;
+    category = category.substr(0, min(category.size(), kTextSize));
+    if (!category.empty()) {
+        joined.assign(category);
+        joined.append(text);
+        text = joined;
+    }
+    uint64_t max_slots = max<uint64_t>(1, (mask_ + 1) / 4);
+    uint64_t count = min(max_slots, max<uint64_t>(1, (text.size() + kTextSize - 1) / kTextSize));
+    text = text.substr(0, min<size_t>(text.size(), count * kTextSize));
+
+    // Slots are freed in order, so the run is free when its first and last
+    // slots are.
+    uint64_t position = header_->head.load(memory_order_relaxed);
+    while (true) {
+        int64_t first_diff = static_cast<int64_t>(SlotAt(position).sequence.load(memory_order_acquire) - position);
+        int64_t last_diff = static_cast<int64_t>(
+            SlotAt(position + count - 1).sequence.load(memory_order_acquire) - (position + count - 1));
+        if (first_diff == 0 && last_diff == 0) {
+            if (header_->head.compare_exchange_weak(position, position + count, memory_order_relaxed))
+                break;
+        } else if (first_diff < 0 || last_diff < 0) {
+            return false;
+        } else {
+            position = header_->head.load(memory_order_relaxed);
+        }
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        Slot& slot = SlotAt(position + i);
+        string_view part = text.substr(min<size_t>(text.size(), i * kTextSize), kTextSize);
+        slot.slots = i == 0 ? static_cast<uint32_t>(count) : 0;
+        slot.size = static_cast<uint32_t>(part.size());
+        slot.timestamp = timestamp;
+        slot.level = static_cast<uint16_t>(level);
+        slot.category_size = static_cast<uint16_t>(i == 0 ? category.size() : 0);
+        memcpy(slot.text, part.data(), part.size());
+    }
+    for (uint64_t i = count; i-- > 0;)
+        SlotAt(position + i).sequence.store(position + i + 1, memory_order_release);
+    return true;
+}
+
+void SharedRing::Close() {
+    header_->is_closed.store(1, memory_order_release);
+}
+
+unique_ptr<SharedRing> SharedRing::Open(const string& name) {
+    int fd = shm_open(("/" + name).c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return nullptr;
+    struct stat file_stat;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && static_cast<size_t>(file_stat.st_size) > sizeof(Header))
+        data = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    Header* header = static_cast<Header*>(data);
+    uint64_t capacity = header->capacity;
+    if (header->magic.load(memory_order_acquire) != kMagic || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        sizeof(Header) + capacity * sizeof(Slot) != static_cast<size_t>(file_stat.st_size)) {
+        munmap(data, file_stat.st_size);
+        close(fd);
+        return nullptr;
+    }
+    return unique_ptr<SharedRing>(new SharedRing(name, fd, data, file_stat.st_size));
+}
+
+bool SharedRing::TryPop(Record& record, bool is_abandoned) {
+    auto release = [this](uint64_t position, uint64_t count) {
+        for (uint64_t i = 0; i < count; i++)
+            SlotAt(position + i).sequence.store(position + i + mask_ + 1, memory_order_release);
+        header_->tail.store(position + count, memory_order_release);
+    };
+
+    while (true) {
+        uint64_t position = header_->tail.load(memory_order_relaxed);
+        Slot& slot = SlotAt(position);
+        if (slot.sequence.load(memory_order_acquire) != position + 1) {
+            if (is_abandoned && position < header_->head.load(memory_order_acquire)) {
+                release(position, 1);
+                continue;
+            }
+            return false;
+        }
+        // The rest of a record whose first slot was skipped above.
+        if (slot.slots == 0 || slot.slots > max<uint64_t>(1, (mask_ + 1) / 4)) {
+            release(position, 1);
+            continue;
+        }
+        record.level = slot.level;
+        record.timestamp = slot.timestamp;
+        record.text.clear();
+        for (uint64_t i = 0; i < slot.slots; i++) {
+            Slot& part = SlotAt(position + i);
+            record.text.append(part.text, min<size_t>(part.size, sizeof(part.text)));
+        }
+        size_t category_size = min<size_t>(slot.category_size, record.text.size());
+        record.category.assign(record.text, 0, category_size);
+        record.text.erase(0, category_size);
+        release(position, slot.slots);
+        return true;
+    }
+}
+
+bool SharedRing::Empty() const {
+    return header_->tail.load(memory_order_acquire) >= header_->head.load(memory_order_acquire);
+}
+
+bool SharedRing::IsAbandoned() const {
+    if (header_->is_closed.load(memory_order_acquire))
+        return true;
+    if (kill(static_cast<pid_t>(header_->pid), 0) != 0 && errno == ESRCH)
+        return true;
+    struct stat mapped, current;
+    int fd = shm_open(("/" + name_).c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return true;
+    bool is_replaced = fstat(fd, &current) != 0 || fstat(fd_, &mapped) != 0 || current.st_ino != mapped.st_ino;
+    close(fd);
+    return is_replaced;
+}
+
+// Leaves the name alone once it belongs to a newer ring.
+void SharedRing::Unlink() const {
+    struct stat mapped, current;
+    int fd = shm_open(("/" + name_).c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &current) == 0 && fstat(fd_, &mapped) == 0 && current.st_ino == mapped.st_ino)
+        shm_unlink(("/" + name_).c_str());
+    close(fd);
+}
+
+SharedRing::Slot& SharedRing::SlotAt(uint64_t position) const {
+    return slots_[position & mask_];
+}
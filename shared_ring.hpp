@@ -0,0 +1,74 @@
+#ifndef _SHARED_RING_HPP_
+#define _SHARED_RING_HPP_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace logger {
+    using namespace std;
+
+    // Queue of text records in a POSIX shared memory object, written by the
+    // threads of one process ("shm=" loggers) and read by logcollector.
+    // Producers claim runs of fixed-size slots with the sequence-per-cell
+    // scheme of RingBuffer and never wait for the reader: a full ring drops
+    // the record. Everything lives in the shared object, so published records
+    // outlive a crashed producer and a restarted collector continues where
+    // the previous one stopped.
+    class SharedRing
+    {
+    public:
+        static constexpr size_t kSlotSize = 512;
+
+        struct Record
+        {
+            uint32_t level;
+            int64_t timestamp;
+            // Name of the producer's Logger::Category(), empty for none.
+            string category;
+            string text;
+        };
+
+        ~SharedRing();
+
+        SharedRing(const SharedRing&) = delete;
+        SharedRing& operator=(const SharedRing&) = delete;
+
+        // Producer side: creates (or replaces) the object "/<name>" with room
+        // for capacity slots. Returns nullptr when it can not be created.
+        static unique_ptr<SharedRing> Create(const string& name, size_t capacity);
+        // Texts longer than a quarter of the ring are cut.
+        bool TryPush(uint32_t level, int64_t timestamp, string_view category, string_view text);
+        // The producer is done; the collector removes the ring once drained.
+        void Close();
+
+        // Collector side. Returns nullptr while the producer has not finished
+        // setting the object up.
+        static unique_ptr<SharedRing> Open(const string& name);
+        // With is_abandoned, slots the producer claimed but never published
+        // are skipped instead of waited for.
+        bool TryPop(Record& record, bool is_abandoned);
+        bool Empty() const;
+        // Closed, its process is gone, or the name now belongs to another ring.
+        bool IsAbandoned() const;
+        void Unlink() const;
+
+    private:
+        struct Header;
+        struct Slot;
+
+        SharedRing(const string& name, int fd, void* data, size_t size);
+        Slot& SlotAt(uint64_t position) const;
+
+        string name_;
+        int fd_;
+        size_t size_;
+        Header* header_;
+        Slot* slots_;
+        uint64_t mask_;
+    };
+}
+#endif
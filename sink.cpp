@@ -0,0 +1,682 @@
+#include "logger.hpp"
+#include "binary_log.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace logger;
+
+namespace {
+    // First moment after timestamp that is a multiple of interval_s in local
+    // time, so that e.g. daily files start at local midnight.
+    int64_t NextRotationTime(int64_t timestamp, int64_t interval_s) {
+        time_t seconds = timestamp / 1000000000;
+        tm local_time;
+        localtime_r(&seconds, &local_time);
+        int64_t offset = local_time.tm_gmtoff;
+        return ((seconds + offset) / interval_s + 1) * interval_s - offset;
+    }
+
+    // Used length of a mapped file reopened after a crash, which leaves the
+    // preallocated zero tail in place. Text records end in '\n', so the data
+    // ends at the last non-zero byte; a binary segment is walked record by
+    // record, as its last record may end in zero bytes.
+    size_t UsedLength(const char* data, size_t size) {
+        if (size > sizeof(binary::kMagic) && data[0] == binary::SEGMENT_HEADER &&
+            memcmp(data + 1, binary::kMagic, sizeof(binary::kMagic)) == 0)
+            return binary::SegmentEnd(data, size);
+        while (size > 0 && data[size - 1] == 0)
+            size--;
+        return size;
+    }
+
+    // Removes the oldest rotated files (path_N.ext and path_N.gz with their
+    // .idx sidecars, one entry per N up to newest_index) beyond the
+    // configured count, size and age. A file still waiting for the archiver
+    // counts but stays; a later pass removes it once compressed.
+    void ApplyRetention(const SinkConfig& config, unsigned int newest_index, Archiver* archiver) {
+        if (config.retention_files == 0 && config.retention_bytes == 0 && config.retention_age_s == 0)
+            return;
+        size_t unit_pos = config.path_to_log_file.find_last_of(".");
+        filesystem::path prefix = config.path_to_log_file.substr(0, unit_pos) + "_";
+        string extension = config.path_to_log_file.substr(unit_pos);
+        string name_prefix = prefix.filename().string();
+        filesystem::path directory = prefix.parent_path();
+        if (directory.empty())
+            directory = ".";
+
+        struct RotatedFile
+        {
+            vector<filesystem::path> paths;
+            size_t size = 0;
+            filesystem::file_time_type write_time = filesystem::file_time_type::min();
+        };
+        map<unsigned int, RotatedFile, greater<unsigned int>> rotated_files;
+        error_code error;
+        for (auto& entry : filesystem::directory_iterator(directory, error)) {
+            string name = entry.path().filename().string();
+            if (name.compare(0, name_prefix.size(), name_prefix) != 0)
+                continue;
+            size_t digits_end = name.find_first_not_of("0123456789", name_prefix.size());
+            if (digits_end == name_prefix.size() || digits_end == string::npos)
+                continue;
+            string suffix = name.substr(digits_end);
+            if (suffix != extension && suffix != ".gz" && suffix != extension + ".idx" && suffix != ".gz.idx")
+                continue;
+            unsigned int index = stoul(name.substr(name_prefix.size(), digits_end - name_prefix.size()));
+            if (index > newest_index)
+                continue;
+            RotatedFile& rotated_file = rotated_files[index];
+            rotated_file.paths.push_back(entry.path());
+            rotated_file.size += entry.file_size(error);
+            rotated_file.write_time = max(rotated_file.write_time, entry.last_write_time(error));
+        }
+
+        auto oldest_kept = filesystem::file_time_type::clock::now() - chrono::seconds(config.retention_age_s);
+        size_t count = 0;
+        size_t total_size = 0;
+        for (auto& [index, rotated_file] : rotated_files) {
+            count++;
+            total_size += rotated_file.size;
+            if ((config.retention_files > 0 && count > config.retention_files) ||
+                (config.retention_bytes > 0 && total_size > config.retention_bytes) ||
+                (config.retention_age_s > 0 && rotated_file.write_time < oldest_kept)) {
+                if (archiver && archiver->IsPending(prefix.string() + to_string(index) + extension))
+                    continue;
+                for (auto& path : rotated_file.paths)
+                    filesystem::remove(path, error);
+            }
+        }
+    }
+}
+
+Sink::Sink(const SinkConfig& config)
+    : level_(config.log_level),
+      buffer_size_(config.buffer_size),
+      flush_interval_ms_(config.flush_interval_ms),
+      flush_level_(config.flush_level),
+      last_flush_time_(chrono::steady_clock::now()) {
+    buffer_.reserve(buffer_size_ + 1024);
+}
+
+void Sink::Write(LogLevel level, const char* data, size_t size) {
+    buffer_.append(data, size);
+    if (level <= flush_level_)
+        is_flush_needed_ = true;
+}
+
+void Sink::FlushIfDue() {
+    if (is_flush_needed_ || buffer_.size() >= buffer_size_ || flush_interval_ms_ == 0 ||
+        chrono::steady_clock::now() - last_flush_time_ >= chrono::milliseconds(flush_interval_ms_)) {
+        Flush();
+    }
+}
+
+void Sink::Flush() {
+    is_flush_needed_ = false;
+    last_flush_time_ = chrono::steady_clock::now();
+    if (buffer_.empty())
+        return;
+    try {
+        WriteOut(buffer_.data(), buffer_.size());
+        Increment(bytes_written_, buffer_.size());
+        Increment(flushes_);
+    } catch (exception& e) {
+        cerr << "Logger error occured: " << e.what() << endl;
+    }
+    buffer_.clear();
+}
+
+unsigned int Sink::FlushTimeout() const {
+    if (buffer_.empty())
+        return 0;
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - last_flush_time_);
+    if (elapsed.count() >= flush_interval_ms_)
+        return 0;
+    return flush_interval_ms_ - elapsed.count();
+}
+
+StreamSink::StreamSink(const SinkConfig& config, ostream& stream) : Sink(config), stream_(stream) {}
+
+StreamSink::~StreamSink() {
+    Flush();
+}
+
+void StreamSink::WriteOut(const char* data, size_t size) {
+    stream_.write(data, size);
+    stream_.flush();
+    if (stream_.fail())
+        throw errors::StreamWorkFailed();
+}
+
+RotatingSink::RotatingSink(const SinkConfig& config, Archiver* archiver)
+    : Sink(config), config_(config), archiver_(archiver) {
+    if (!archiver_)
+        config_.is_file_needed_to_archivate = false;
+}
+
+// Time-based rotation: the first record of a new period starts a new file.
+void RotatingSink::StartRecord(int64_t timestamp) {
+    record_timestamp_ = timestamp;
+    if (config_.rotate_interval_s <= 0 || timestamp < next_rotation_time_ * 1000000000)
+        return;
+    bool is_rotation_due = next_rotation_time_ != 0 && !IsFileEmpty();
+    next_rotation_time_ = NextRotationTime(timestamp, config_.rotate_interval_s);
+    if (is_rotation_due)
+        Rotate();
+}
+
+string RotatingSink::OpenFilename() {
+    string current_log_file_name;
+    if (!config_.is_file_needed_to_archivate)
+        current_log_file_name = GetFilename();
+    else
+        current_log_file_name = config_.path_to_log_file;
+    file_number_++;
+    return current_log_file_name;
+}
+
+string RotatingSink::NextFilename() {
+    if (config_.is_file_needed_to_archivate)
+        return config_.path_to_log_file + ".next";
+    return GetFilename();
+}
+
+string RotatingSink::GetFilename() {
+    return GetFilename(file_number_);
+}
+
+string RotatingSink::GetFilename(unsigned int file_number) {
+    size_t unit_pos = config_.path_to_log_file.find_last_of(".");
+    string unit = config_.path_to_log_file.substr(0, unit_pos);
+    unit = unit + "_" + to_string(file_number) +
+        config_.path_to_log_file.substr(unit_pos);
+    return unit;
+}
+
+const char* RotatingSink::GetZipName(string& base_filename) {
+    size_t unit_pos = config_.path_to_log_file.find_last_of(".");
+    base_filename = config_.path_to_log_file.substr(0, unit_pos);
+    base_filename = base_filename + "_" + to_string(file_number_) + ".gz";
+    return base_filename.c_str();
+}
+
+// With archiving the prepared file was opened as path.next and takes the
+// place of path once the finished file is renamed. Without a prepared file
+// the work is done right away, before the next file is opened under path.
+void RotatingSink::FinishFile(function<void()> close_file, bool is_next_prepared) {
+    segment_++;
+    Increment(rotations_);
+    bool is_archiving = config_.is_file_needed_to_archivate;
+    unsigned int index = is_archiving ? file_number_ : file_number_ - 1;
+    string path = config_.path_to_log_file;
+    string next_filename = next_filename_;
+    string rotated_filename;
+    string zipname;
+    if (is_archiving) {
+        rotated_filename = GetFilename();
+        GetZipName(zipname);
+    } else {
+        rotated_filename = GetFilename(index);
+    }
+    shared_ptr<const SegmentIndex> segment_index;
+    if (config_.is_indexed && !index_.Empty())
+        segment_index = make_shared<SegmentIndex>(move(index_));
+    ResetIndex();
+
+    auto task = [=, config = config_, archiver = archiver_] {
+        try {
+            close_file();
+            auto retain = [config, index, archiver] {
+                ApplyRetention(config, index, archiver);
+            };
+            if (!is_archiving) {
+                if (segment_index)
+                    segment_index->Write(rotated_filename + ".idx");
+                retain();
+                return;
+            }
+            if (rename(path.c_str(), rotated_filename.c_str()))
+                throw errors::InvalidLogOrZipFilename();
+            if (is_next_prepared && rename(next_filename.c_str(), path.c_str()))
+                throw errors::InvalidLogOrZipFilename();
+            // Deferred: the file stays readable as it is until its turn.
+            if (!archiver->Submit(rotated_filename, zipname, retain, segment_index)) {
+                if (segment_index)
+                    segment_index->Write(rotated_filename + ".idx");
+                retain();
+            }
+        } catch (exception& e) {
+            cerr << "Logger error occured: " << e.what() << endl;
+        }
+    };
+    if (archiver_ && is_next_prepared)
+        archiver_->Post(task);
+    else
+        task();
+}
+
+// A sidecar left by an earlier run no longer matches the file once more
+// records are appended to it, so it goes away until the file is finished.
+void RotatingSink::StartIndex(const string& filename, uint64_t existing_size) {
+    if (!config_.is_indexed)
+        return;
+    remove((filename + ".idx").c_str());
+    index_.base_offset = existing_size;
+}
+
+void RotatingSink::ResetIndex() {
+    index_.Clear();
+    index_.is_compressed = is_index_compressed_;
+    index_offset_ = 0;
+}
+
+void RotatingSink::WriteCurrentIndex() {
+    if (!config_.is_indexed || index_.Empty() || file_number_ == 0)
+        return;
+    string filename = config_.is_file_needed_to_archivate ? config_.path_to_log_file : GetFilename(file_number_ - 1);
+    index_.Write(filename + ".idx");
+}
+
+FileSink::FileSink(const SinkConfig& config, Archiver* archiver) : RotatingSink(config, archiver) {}
+
+FileSink::~FileSink() {
+    Flush();
+    if (file_stream_.is_open()) {
+        file_stream_.close();
+        WriteCurrentIndex();
+    }
+    // A prepared file that was never used is removed again.
+    if (next_stream_) {
+        OpenedStream next = TakePrepared(*next_stream_);
+        if (next.stream.is_open()) {
+            next.stream.close();
+            if (next.size == 0)
+                remove(next_filename_.c_str());
+        }
+    }
+}
+
+// The record that reaches the size limit is the last one of its file.
+void FileSink::Write(LogLevel level, const char* data, size_t size) {
+    IndexRecord(level, size);
+    Sink::Write(level, data, size);
+    if (config_.file_size_limit > 0 && file_bytes_written_ + buffer_.size() >= config_.file_size_limit)
+        Rotate();
+}
+
+void FileSink::WriteOut(const char* data, size_t size) {
+    ostream& output_stream = GetOutputStream();
+    output_stream.write(data, size);
+    output_stream.flush();
+
+    if (output_stream.fail()) {
+        throw errors::StreamWorkFailed();
+    }
+    file_bytes_written_ += size;
+}
+
+bool FileSink::IsFileEmpty() const {
+    return file_bytes_written_ + buffer_.size() == 0;
+}
+
+void FileSink::Rotate() {
+    Flush();
+    if (!file_stream_.is_open())
+        return;
+    OpenedStream next;
+    bool is_next_prepared = false;
+    if (next_stream_) {
+        next = TakePrepared(*next_stream_);
+        next_stream_.reset();
+        is_next_prepared = next.stream.is_open();
+    }
+
+    auto finished_stream = make_shared<ofstream>(move(file_stream_));
+    FinishFile([finished_stream] {
+        finished_stream->close();
+    }, is_next_prepared);
+    file_bytes_written_ = 0;
+    if (is_next_prepared) {
+        file_stream_ = move(next.stream);
+        file_bytes_written_ = next.size;
+        StartIndex(next_filename_, next.size);
+        file_number_++;
+        next_stream_ = PrepareFile<OpenedStream>(OpenStream);
+    }
+}
+
+FileSink::OpenedStream FileSink::OpenStream(const string& filename) {
+    OpenedStream opened;
+    // Records are already buffered by the sink, let writes go straight to the file.
+    opened.stream.rdbuf()->pubsetbuf(nullptr, 0);
+    opened.stream.open(filename, ios::out | ios::app | ios::binary);
+    if (opened.stream.is_open()) {
+        opened.stream.seekp(0, ios::end);
+        opened.size = opened.stream.tellp();
+    }
+    return opened;
+}
+
+ostream& FileSink::GetOutputStream() {
+    if (file_stream_.is_open())
+        return file_stream_;
+
+    string filename = OpenFilename();
+    OpenedStream opened = OpenStream(filename);
+    if (!opened.stream.is_open()) {
+        throw errors::StreamNotOpened();
+    }
+    file_stream_ = move(opened.stream);
+    file_bytes_written_ = opened.size;
+    StartIndex(filename, opened.size);
+    if (IsRotating())
+        next_stream_ = PrepareFile<OpenedStream>(OpenStream);
+    return file_stream_;
+}
+
+MmapFileSink::MmapFileSink(const SinkConfig& config, Archiver* archiver)
+    : RotatingSink(config, archiver), last_sync_time_(chrono::steady_clock::now()) {}
+
+MmapFileSink::~MmapFileSink() {
+    if (file_.fd >= 0) {
+        CloseMapped(file_, config_.msync_interval_ms > 0);
+        WriteCurrentIndex();
+    }
+    if (next_file_) {
+        MappedFile next = TakePrepared(*next_file_);
+        bool is_next_empty = next.offset == 0;
+        if (next.fd >= 0) {
+            CloseMapped(next, false);
+            if (is_next_empty)
+                remove(next_filename_.c_str());
+        }
+    }
+}
+
+// Like FileSink, the record that reaches the size limit is the last one of
+// its segment: a record that does not fit grows the segment instead.
+void MmapFileSink::Write(LogLevel level, const char* data, size_t size) {
+    IndexRecord(level, size);
+    WriteOut(data, size);
+    Increment(bytes_written_, size);
+    if (IsUrgent(level))
+        is_sync_needed_ = true;
+    if (config_.file_size_limit > 0 && file_.offset >= config_.file_size_limit)
+        Rotate();
+}
+
+void MmapFileSink::WriteOut(const char* data, size_t size) {
+    if (file_.fd < 0) {
+        string filename = OpenFilename();
+        file_ = OpenMapped(filename, config_.file_size_limit);
+        if (file_.fd < 0) {
+            // Tried again under the same name with the next record.
+            file_number_--;
+            throw errors::StreamNotOpened();
+        }
+        StartIndex(filename, file_.offset);
+        synced_offset_ = file_.offset;
+        if (IsRotating()) {
+            next_file_ = PrepareFile<MappedFile>([file_size_limit = config_.file_size_limit](const string& filename) {
+                return OpenMapped(filename, file_size_limit);
+            });
+        }
+    }
+    if (file_.offset + size > file_.capacity) {
+        size_t capacity = file_.offset + size;
+        if (config_.file_size_limit == 0)
+            capacity = file_.capacity + max(kGrowStep, size);
+        if (!MapFile(file_, capacity))
+            throw errors::StreamWorkFailed();
+    }
+    memcpy(file_.data + file_.offset, data, size);
+    file_.offset += size;
+}
+
+bool MmapFileSink::IsFileEmpty() const {
+    return file_.offset == 0;
+}
+
+void MmapFileSink::Rotate() {
+    if (file_.fd < 0)
+        return;
+    MappedFile next;
+    bool is_next_prepared = false;
+    if (next_file_) {
+        next = TakePrepared(*next_file_);
+        next_file_.reset();
+        is_next_prepared = next.fd >= 0;
+    }
+
+    bool is_sync_needed = config_.msync_interval_ms > 0;
+    FinishFile([finished_file = file_, is_sync_needed]() mutable {
+        CloseMapped(finished_file, is_sync_needed);
+    }, is_next_prepared);
+    file_ = MappedFile();
+    if (is_next_prepared) {
+        file_ = next;
+        StartIndex(next_filename_, file_.offset);
+        file_number_++;
+        next_file_ = PrepareFile<MappedFile>([file_size_limit = config_.file_size_limit](const string& filename) {
+            return OpenMapped(filename, file_size_limit);
+        });
+    }
+    synced_offset_ = file_.offset;
+    is_sync_needed_ = false;
+}
+
+// msync= sets how often written records are forced to disk; with 0 that is
+// left to the kernel writeback.
+void MmapFileSink::FlushIfDue() {
+    if (config_.msync_interval_ms == 0 || file_.offset == synced_offset_)
+        return;
+    if (is_sync_needed_ ||
+        chrono::steady_clock::now() - last_sync_time_ >= chrono::milliseconds(config_.msync_interval_ms)) {
+        Sync();
+    }
+}
+
+void MmapFileSink::Flush() {
+    if (config_.msync_interval_ms > 0)
+        Sync();
+}
+
+unsigned int MmapFileSink::FlushTimeout() const {
+    if (config_.msync_interval_ms == 0 || file_.offset == synced_offset_)
+        return 0;
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - last_sync_time_);
+    if (elapsed.count() >= config_.msync_interval_ms)
+        return 0;
+    return config_.msync_interval_ms - elapsed.count();
+}
+
+// Returns a file with fd -1 when it can not be opened or mapped.
+MmapFileSink::MappedFile MmapFileSink::OpenMapped(const string& filename, size_t file_size_limit) {
+    MappedFile file;
+    file.fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (file.fd < 0)
+        return file;
+    struct stat file_stat;
+    size_t capacity = 0;
+    if (fstat(file.fd, &file_stat) == 0) {
+        file.offset = file_stat.st_size;
+        capacity = file_size_limit > 0 ? max(file_size_limit, file.offset) : file.offset + kGrowStep;
+    }
+    if (capacity == 0 || !MapFile(file, capacity)) {
+        close(file.fd);
+        file.fd = -1;
+        if (file.offset == 0)
+            remove(filename.c_str());
+        return file;
+    }
+    file.offset = UsedLength(file.data, file.offset);
+    return file;
+}
+
+// On a full disk the current mapping is kept, so that a later attempt can
+// still grow it.
+bool MmapFileSink::MapFile(MappedFile& file, size_t capacity) {
+    // Reserving the blocks up front turns a full disk into an error here
+    // instead of a SIGBUS on a later store into the mapping. Only a file
+    // system that can not reserve them gets a sparse file.
+    int error = posix_fallocate(file.fd, 0, capacity);
+    if (error == EOPNOTSUPP || error == EINVAL)
+        error = ftruncate(file.fd, capacity) == 0 ? 0 : errno;
+    if (error != 0)
+        return false;
+    if (file.data) {
+        munmap(file.data, file.capacity);
+        file.data = nullptr;
+        file.capacity = 0;
+    }
+    void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+    file.data = static_cast<char*>(data);
+    file.capacity = capacity;
+    return true;
+}
+
+void MmapFileSink::CloseMapped(MappedFile& file, bool is_sync_needed) {
+    if (file.fd < 0)
+        return;
+    if (file.data) {
+        if (is_sync_needed)
+            msync(file.data, file.offset, MS_SYNC);
+        munmap(file.data, file.capacity);
+    }
+    if (ftruncate(file.fd, file.offset) != 0)
+        cerr << "Logger error occured: " << errors::StreamWorkFailed().what() << endl;
+    close(file.fd);
+    file = MappedFile();
+}
+
+void MmapFileSink::Sync() {
+    is_sync_needed_ = false;
+    last_sync_time_ = chrono::steady_clock::now();
+    if (!file_.data || file_.offset == synced_offset_)
+        return;
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t begin = synced_offset_ & ~(page_size - 1);
+    if (msync(file_.data + begin, file_.offset - begin, MS_SYNC) != 0)
+        cerr << "Logger error occured: " << errors::StreamWorkFailed().what() << endl;
+    else
+        Increment(flushes_);
+    synced_offset_ = file_.offset;
+}
+
+GzipFileSink::GzipFileSink(const SinkConfig& config, Archiver* archiver) : RotatingSink(config, archiver) {
+    size_t unit_pos = config_.path_to_log_file.find_last_of(".");
+    config_.path_to_log_file = config_.path_to_log_file.substr(0, unit_pos) + ".gz";
+    config_.is_file_needed_to_archivate = false;
+    is_index_compressed_ = true;
+    index_.is_compressed = true;
+}
+
+GzipFileSink::~GzipFileSink() {
+    Flush();
+    if (file_) {
+        gzclose(file_);
+        WriteCurrentIndex();
+    }
+    if (next_file_) {
+        gzFile next = TakePrepared(*next_file_);
+        if (next) {
+            bool is_next_empty = gzoffset(next) == 0;
+            gzclose(next);
+            if (is_next_empty)
+                remove(next_filename_.c_str());
+        }
+    }
+}
+
+// The size is only known once buffered records are compressed, so the
+// file that passed the limit ends with the record after that write.
+void GzipFileSink::Write(LogLevel level, const char* data, size_t size) {
+    IndexRecord(level, size);
+    Sink::Write(level, data, size);
+    if (config_.file_size_limit > 0 && file_bytes_written_ >= config_.file_size_limit)
+        Rotate();
+}
+
+void GzipFileSink::WriteOut(const char* data, size_t size) {
+    if (!file_) {
+        string filename = OpenFilename();
+        file_ = OpenGzip(filename, config_.compression_level);
+        if (!file_)
+            throw errors::StreamNotOpened();
+        file_bytes_written_ = gzoffset(file_);
+        StartIndex(filename, file_bytes_written_);
+        if (IsRotating()) {
+            next_file_ = PrepareFile<gzFile>([compression_level = config_.compression_level](const string& filename) {
+                return OpenGzip(filename, compression_level);
+            });
+        }
+    }
+    // "index": every kBlockSize bytes a full flush resets the compressor, so
+    // that logquery can start inflating there. Sink::Flush always writes the
+    // whole buffer, so everything indexed so far is written by now.
+    bool is_restart = config_.is_indexed && index_offset_ - last_restart_offset_ >= SegmentIndex::kBlockSize;
+    if (gzwrite(file_, data, size) != static_cast<int>(size) ||
+        gzflush(file_, is_restart ? Z_FULL_FLUSH : Z_SYNC_FLUSH) != Z_OK)
+        throw errors::StreamWorkFailed();
+    file_bytes_written_ = gzoffset(file_);
+    if (is_restart) {
+        index_.AddRestart(index_offset_, file_bytes_written_);
+        last_restart_offset_ = index_offset_;
+    }
+}
+
+bool GzipFileSink::IsFileEmpty() const {
+    return file_bytes_written_ + buffer_.size() == 0;
+}
+
+void GzipFileSink::Rotate() {
+    Flush();
+    if (!file_)
+        return;
+    gzFile next = nullptr;
+    if (next_file_) {
+        next = TakePrepared(*next_file_);
+        next_file_.reset();
+    }
+
+    FinishFile([finished_file = file_] {
+        gzclose(finished_file);
+    }, next != nullptr);
+    file_ = nullptr;
+    file_bytes_written_ = 0;
+    last_restart_offset_ = 0;
+    if (next) {
+        file_ = next;
+        file_bytes_written_ = gzoffset(file_);
+        StartIndex(next_filename_, file_bytes_written_);
+        file_number_++;
+        next_file_ = PrepareFile<gzFile>([compression_level = config_.compression_level](const string& filename) {
+            return OpenGzip(filename, compression_level);
+        });
+    }
+}
+
+// An existing file gets another gzip member appended, which zcat and
+// logdecode read as one stream.
+gzFile GzipFileSink::OpenGzip(const string& filename, int compression_level) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+    string mode = "ab";
+    if (compression_level >= 0)
+        mode += to_string(compression_level);
+    gzFile file = gzdopen(fd, mode.c_str());
+    if (!file) {
+        close(fd);
+        return nullptr;
+    }
+    gzbuffer(file, Archiver::kChunkSize);
+    return file;
+}
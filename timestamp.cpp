@@ -0,0 +1,74 @@
+#include "timestamp.hpp"
+#include <cstring>
+#include <ctime>
+#include <limits>
+
+using namespace logger;
+
+namespace {
+    void WriteDigits(char* out, unsigned int value, int width) {
+        for (int i = width - 1; i >= 0; i--) {
+            out[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+    }
+}
+
+TimestampFormatter::TimestampFormatter() : cached_second_(numeric_limits<int64_t>::min()) {
+    // Reads TZ once; localtime_r does not re-read it afterwards.
+    tzset();
+}
+
+void TimestampFormatter::Configure(bool is_date_logging, bool is_time_logging) {
+    is_date_logging_ = is_date_logging;
+    is_time_logging_ = is_time_logging;
+}
+
+size_t TimestampFormatter::Format(int64_t timestamp_ns, char* out) {
+    if (!is_date_logging_ && !is_time_logging_)
+        return 0;
+
+    int64_t second = timestamp_ns / 1000000000;
+    int64_t nanoseconds = timestamp_ns % 1000000000;
+    if (nanoseconds < 0) {
+        nanoseconds += 1000000000;
+        second--;
+    }
+    if (second != cached_second_)
+        Refresh(second);
+
+    size_t length = 0;
+    if (is_date_logging_) {
+        memcpy(out, date_, sizeof(date_));
+        length += sizeof(date_);
+    }
+    if (is_time_logging_) {
+        memcpy(out + length, time_, sizeof(time_));
+        length += sizeof(time_);
+        out[length++] = '.';
+        WriteDigits(out + length, static_cast<unsigned int>(nanoseconds), 9);
+        length += 9;
+        out[length++] = ' ';
+    }
+    return length;
+}
+
+void TimestampFormatter::Refresh(int64_t second) {
+    time_t time = static_cast<time_t>(second);
+    tm local;
+    localtime_r(&time, &local);
+
+    WriteDigits(date_, local.tm_year + 1900, 4);
+    date_[4] = '-';
+    WriteDigits(date_ + 5, local.tm_mon + 1, 2);
+    date_[7] = '-';
+    WriteDigits(date_ + 8, local.tm_mday, 2);
+    date_[10] = ' ';
+
+    WriteDigits(time_, local.tm_hour, 2);
+    time_[2] = ':';
+    WriteDigits(time_ + 3, local.tm_min, 2);
+    time_[5] = ':';
+    WriteDigits(time_ + 6, local.tm_sec, 2);
+    cached_second_ = second;
+}
@@ -0,0 +1,39 @@
+#ifndef _TIMESTAMP_HPP_
+#define _TIMESTAMP_HPP_
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace logger {
+    using namespace std;
+
+    inline int64_t TimestampNow() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Formats "YYYY-MM-DD HH:MM:SS.nnnnnnnnn " in local time. The part up to
+    // the second is cached and rebuilt only when the second changes, so the
+    // common case is two memcpy's and nine digits. Not thread-safe: every
+    // consumer owns its own formatter.
+    class TimestampFormatter
+    {
+    public:
+        static constexpr size_t kMaxLength = 31;
+
+        TimestampFormatter();
+
+        void Configure(bool is_date_logging, bool is_time_logging);
+        size_t Format(int64_t timestamp_ns, char* out);
+
+    private:
+        void Refresh(int64_t second);
+
+        bool is_date_logging_ = false;
+        bool is_time_logging_ = false;
+        int64_t cached_second_;
+        char date_[11];
+        char time_[8];
+    };
+}
+#endif